@@ -0,0 +1,494 @@
+#include <lilray.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace lilray;
+
+#define RAD_TO_DEG (180.f / 3.14159265359f)
+
+// Headless benchmark, renders camera paths over the demo map and generated
+// maps offscreen and reports frame times per stage as JSON, along with the
+// average per frame counters from Renderer::stats. lilray.cpp has to be
+// compiled with LILRAY_ENABLE_STATS.
+//
+// Usage: lilray_bench [--width n] [--height n] [--frames n] [--warmup n]
+//                     [--threads n] [--fixed-point] [--no-mipmaps]
+//                     [--sprite-grid] [--check-sprite-grid] [--path file]
+//                     [--cell-type int32|uint16|uint8] [--dda] [--output file]
+//
+// --no-mipmaps samples full size textures only. --sprite-grid renders the
+// sprites through a SpriteGrid instead of the plain sprite array.
+// --check-sprite-grid skips benchmarking and instead checks that both ways
+// render identical frames, with sprites inside and outside the map, and exits
+// with 1 if any frame differs. --path replaces the scripted camera path over
+// the demo map with a recorded one, a text file with one "x y angle" camera
+// pose per line. --cell-type sets the storage type of map cells, see
+// MapCellType. --dda skips rendering and instead measures DDA steps per second
+// for horizontal, vertical and diagonal rays over a large map, for each
+// MapLayout.
+
+struct Pose {
+	float x, y, angle;
+};
+
+struct Scene {
+	const char *name;
+	Map *map;
+	Sprite **sprites;
+	int32_t numSprites;
+	Pose *poses;
+	int32_t numPoses;
+};
+
+// clang-format off
+static int32_t demoCells[] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 3, 3, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 1, 1, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0,
+	4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 2, 2, 2, 0, 4, 4, 4, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+// clang-format on
+
+static uint32_t randomState = 1;
+
+static uint32_t nextRandom() {
+	randomState = randomState * 1664525 + 1013904223;
+	return randomState >> 8;
+}
+
+// Samples numPoses poses evenly spaced along the polyline through the
+// waypoints, looking in the direction of travel and sweeping left and right.
+static Pose *createPath(const float *waypoints, int32_t numWaypoints, int32_t numPoses) {
+	float length = 0;
+	for (int32_t i = 0; i < numWaypoints - 1; i++)
+		length += hypotf(waypoints[i * 2 + 2] - waypoints[i * 2], waypoints[i * 2 + 3] - waypoints[i * 2 + 1]);
+	Pose *poses = new Pose[numPoses];
+	int32_t segment = 0;
+	float segmentStart = 0;
+	for (int32_t i = 0; i < numPoses; i++) {
+		float position = length * float(i) / float(numPoses);
+		const float *a = waypoints + segment * 2, *b = a + 2;
+		float segmentLength = hypotf(b[0] - a[0], b[1] - a[1]);
+		while (position > segmentStart + segmentLength && segment < numWaypoints - 2) {
+			segmentStart += segmentLength;
+			segment++;
+			a = waypoints + segment * 2, b = a + 2;
+			segmentLength = hypotf(b[0] - a[0], b[1] - a[1]);
+		}
+		float t = segmentLength > 0 ? (position - segmentStart) / segmentLength : 0;
+		poses[i].x = a[0] + (b[0] - a[0]) * t;
+		poses[i].y = a[1] + (b[1] - a[1]) * t;
+		poses[i].angle = atan2f(b[1] - a[1], b[0] - a[0]) * RAD_TO_DEG + 40 * sinf(float(i) * 0.05f);
+	}
+	return poses;
+}
+
+static Pose *loadPath(const char *file, int32_t &numPoses) {
+	FILE *in = fopen(file, "r");
+	if (!in)
+		return nullptr;
+	int32_t capacity = 256;
+	Pose *poses = new Pose[capacity];
+	numPoses = 0;
+	Pose pose;
+	while (fscanf(in, "%f %f %f", &pose.x, &pose.y, &pose.angle) == 3) {
+		if (numPoses == capacity) {
+			Pose *grown = new Pose[capacity * 2];
+			memcpy(grown, poses, sizeof(Pose) * capacity);
+			delete[] poses;
+			poses = grown;
+			capacity *= 2;
+		}
+		poses[numPoses++] = pose;
+	}
+	fclose(in);
+	return poses;
+}
+
+// Rooms of 8x8 cells with a block of pillars in each and randomly scattered
+// walls. Rows and columns 8 * k + 1 stay clear, the camera path snakes along
+// them. A sprite stands at some of the crossings.
+static Scene createGeneratedScene(const char *name, int32_t size, int32_t numPoses, Image *spriteImage,
+								  MapCellType cellType) {
+	int32_t *cells = new int32_t[size * size];
+	for (int32_t y = 0; y < size; y++) {
+		for (int32_t x = 0; x < size; x++) {
+			int32_t cell = 0;
+			if (x == 0 || y == 0 || x == size - 1 || y == size - 1)
+				cell = 1;
+			else if (x % 8 >= 4 && x % 8 <= 6 && y % 8 >= 4 && y % 8 <= 6)
+				cell = 1 + int32_t(nextRandom() % 7);
+			else if (x % 8 != 1 && y % 8 != 1 && nextRandom() % 100 < 8)
+				cell = 1 + int32_t(nextRandom() % 7);
+			cells[x + y * size] = cell;
+		}
+	}
+	Scene scene;
+	scene.name = name;
+	scene.map = new Map(size, size, cellType, cells);
+	delete[] cells;
+
+	int32_t numCorridors = (size - 3) / 8 + 1;
+	float west = 1.5f, east = float((numCorridors - 1) * 8) + 1.5f;
+	float *waypoints = new float[numCorridors * 4];
+	for (int32_t i = 0; i < numCorridors; i++) {
+		float y = float(i * 8) + 1.5f;
+		waypoints[i * 4] = i % 2 ? east : west;
+		waypoints[i * 4 + 1] = y;
+		waypoints[i * 4 + 2] = i % 2 ? west : east;
+		waypoints[i * 4 + 3] = y;
+	}
+	scene.poses = createPath(waypoints, numCorridors * 2, numPoses);
+	scene.numPoses = numPoses;
+	delete[] waypoints;
+
+	scene.sprites = new Sprite *[numCorridors * numCorridors];
+	scene.numSprites = 0;
+	for (int32_t y = 0; y < numCorridors; y++) {
+		for (int32_t x = 0; x < numCorridors; x++) {
+			if (nextRandom() % 100 < 30)
+				scene.sprites[scene.numSprites++] =
+						new Sprite(float(x * 8) + 1.8f, float(y * 8) + 1.2f, 0.7f, spriteImage);
+		}
+	}
+	return scene;
+}
+
+// Casts packets of rays from random origins over a 4096x4096 map with sparse
+// walls, so rays travel far, and reports the DDA step throughput per layout.
+static void runDDABenchmark(FILE *out, MapCellType cellType) {
+	const int32_t size = 4096, numRays = 1 << 16, numRuns = 5;
+	int32_t *cells = new int32_t[size * size];
+	for (int32_t i = 0; i < size * size; i++)
+		cells[i] = nextRandom() % 1000 < 2 ? 1 + int32_t(nextRandom() % 7) : 0;
+	float *rayX = new float[numRays], *rayY = new float[numRays];
+	for (int32_t i = 0; i < numRays; i++) {
+		rayX[i] = 1 + float(nextRandom() % ((size - 2) * 16)) / 16.0f;
+		rayY[i] = 1 + float(nextRandom() % ((size - 2) * 16)) / 16.0f;
+	}
+	struct Direction {
+		const char *name;
+		float angle;
+	} directions[] = {{"horizontal", 0}, {"vertical", 90}, {"diagonal", 45}};
+	struct Layout {
+		const char *name;
+		MapLayout layout;
+	} layouts[] = {{"rowMajor", MAP_LAYOUT_ROW_MAJOR}, {"tiled", MAP_LAYOUT_TILED}, {"morton", MAP_LAYOUT_MORTON}};
+
+	fprintf(out, "{\n  \"mapWidth\": %i,\n  \"mapHeight\": %i,\n  \"rays\": %i,\n  \"layouts\": [\n", size, size,
+			numRays);
+	for (int32_t i = 0; i < 6; i++) {
+		// Every layout with and without the distance field.
+		bool useDistanceField = i % 2 == 1;
+		Map map(size, size, cellType, cells, layouts[i / 2].layout);
+		if (useDistanceField)
+			map.createDistanceField();
+		fprintf(out, "    {\n      \"name\": \"%s\",\n      \"distanceField\": %s,\n", layouts[i / 2].name,
+				useDistanceField ? "true" : "false");
+		for (int32_t j = 0; j < 3; j++) {
+			// Spread the directions a little, so the rays of a packet diverge.
+			float dirX[Map::PACKET_SIZE], dirY[Map::PACKET_SIZE];
+			for (int32_t k = 0; k < Map::PACKET_SIZE; k++) {
+				float angle = (directions[j].angle + float(k) * 0.5f) / RAD_TO_DEG;
+				dirX[k] = cosf(angle);
+				dirY[k] = sinf(angle);
+			}
+			int64_t numSteps = 0;
+			double bestTime = 0;
+			for (int32_t run = 0; run < numRuns; run++) {
+				int32_t hits[Map::PACKET_SIZE], steps[Map::PACKET_SIZE];
+				float hitX[Map::PACKET_SIZE], hitY[Map::PACKET_SIZE], distance[Map::PACKET_SIZE];
+				numSteps = 0;
+				auto start = std::chrono::steady_clock::now();
+				for (int32_t k = 0; k < numRays; k += Map::PACKET_SIZE) {
+					map.raycastPacket(Map::PACKET_SIZE, rayX + k, rayY + k, dirX, dirY, float(size), hits, hitX, hitY,
+									  distance, steps);
+					for (int32_t l = 0; l < Map::PACKET_SIZE; l++)
+						numSteps += steps[l];
+				}
+				double time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				if (run == 0 || time < bestTime)
+					bestTime = time;
+			}
+			fprintf(out, "      \"%s\": {\"steps\": %lli, \"time\": %.4f, \"mStepsPerSecond\": %.1f}%s\n",
+					directions[j].name, (long long) numSteps, bestTime, double(numSteps) / bestTime / 1000.0,
+					j < 2 ? "," : "");
+		}
+		fprintf(out, "    }%s\n", i < 5 ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+	delete[] rayX;
+	delete[] rayY;
+	delete[] cells;
+}
+
+// Renders random poses in an open 16x16 map, once with
+// the sprite array and once with a SpriteGrid, and reports the poses whose
+// frames differ. Sprites are spread over and around the map, so the grid's
+// cells and its overflow bucket both get culled. Returns the number of
+// differing frames.
+static int32_t checkSpriteGrid(FILE *out, Renderer &renderer, Image *spriteImage, MapCellType cellType) {
+	const int32_t size = 16, numSprites = 400, numPoses = 192;
+	int32_t cells[size * size] = {};
+	Map map(size, size, cellType, cells);
+	Sprite **sprites = new Sprite *[numSprites];
+	for (int32_t i = 0; i < numSprites; i++) {
+		float x = float(nextRandom() % (56 * 16)) / 16.0f - 20, y = float(nextRandom() % (56 * 16)) / 16.0f - 20;
+		sprites[i] = new Sprite(x, y, 0.3f + float(nextRandom() % 8) * 0.1f, spriteImage);
+	}
+	SpriteGrid grid(size, size);
+	grid.update(sprites, numSprites);
+
+	Image &frame = renderer.frame;
+	uint32_t *expected = new uint32_t[frame.pitch * frame.height];
+	int32_t numMismatches = 0;
+	fprintf(out, "{\n  \"poses\": %i,\n  \"sprites\": %i,\n  \"mismatches\": [", numPoses, numSprites);
+	for (int32_t i = 0; i < numPoses; i++) {
+		float x = 0.5f + float(nextRandom() % (15 * 16)) / 16.0f, y = 0.5f + float(nextRandom() % (15 * 16)) / 16.0f;
+		Camera camera(x, y, float(nextRandom() % 360), 66);
+		renderer.render(camera, map, sprites, numSprites, 6);
+		memcpy(expected, frame.pixels, sizeof(uint32_t) * frame.pitch * frame.height);
+		renderer.render(camera, map, grid, 6);
+		int32_t numPixels = 0;
+		for (int32_t y = 0; y < frame.height; y++) {
+			for (int32_t x = 0; x < frame.width; x++)
+				numPixels += frame.pixels[x + y * frame.pitch] != expected[x + y * frame.pitch];
+		}
+		if (numPixels) {
+			fprintf(out, "%s\n    {\"pose\": %i, \"pixels\": %i}", numMismatches ? "," : "", i, numPixels);
+			numMismatches++;
+		}
+	}
+	fprintf(out, "%s]\n}\n", numMismatches ? "\n  " : "");
+	delete[] expected;
+	for (int32_t i = 0; i < numSprites; i++)
+		delete sprites[i];
+	delete[] sprites;
+	return numMismatches;
+}
+
+static void writeStage(FILE *out, const char *name, double *times, int32_t numTimes, bool last) {
+	std::sort(times, times + numTimes);
+	int32_t p99 = int32_t(ceil(double(numTimes) * 0.99)) - 1;
+	fprintf(out, "        \"%s\": {\"min\": %.4f, \"median\": %.4f, \"p99\": %.4f}%s\n", name, times[0],
+			times[numTimes / 2], times[p99 < 0 ? 0 : p99], last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+	int32_t width = 320, height = 240, numFrames = 600, numWarmupFrames = 30, numThreads = 1;
+	bool useFixedPoint = false, useMipmaps = true, useSpriteGrid = false, checkGrid = false, benchmarkDDA = false;
+	const char *pathFile = nullptr, *outputFile = nullptr;
+	MapCellType cellType = MAP_CELL_INT32;
+	for (int32_t i = 1; i < argc; i++) {
+		const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!strcmp(arg, "--fixed-point")) {
+			useFixedPoint = true;
+			continue;
+		}
+		if (!strcmp(arg, "--no-mipmaps")) {
+			useMipmaps = false;
+			continue;
+		}
+		if (!strcmp(arg, "--sprite-grid")) {
+			useSpriteGrid = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-sprite-grid")) {
+			checkGrid = true;
+			continue;
+		}
+		if (!strcmp(arg, "--dda")) {
+			benchmarkDDA = true;
+			continue;
+		}
+		if (!value) {
+			fprintf(stderr, "Unknown or incomplete argument %s\n", arg);
+			return -1;
+		}
+		if (!strcmp(arg, "--width"))
+			width = atoi(value);
+		else if (!strcmp(arg, "--height"))
+			height = atoi(value);
+		else if (!strcmp(arg, "--frames"))
+			numFrames = atoi(value);
+		else if (!strcmp(arg, "--warmup"))
+			numWarmupFrames = atoi(value);
+		else if (!strcmp(arg, "--threads"))
+			numThreads = atoi(value);
+		else if (!strcmp(arg, "--path"))
+			pathFile = value;
+		else if (!strcmp(arg, "--output"))
+			outputFile = value;
+		else if (!strcmp(arg, "--cell-type") && !strcmp(value, "int32"))
+			cellType = MAP_CELL_INT32;
+		else if (!strcmp(arg, "--cell-type") && !strcmp(value, "uint16"))
+			cellType = MAP_CELL_UINT16;
+		else if (!strcmp(arg, "--cell-type") && !strcmp(value, "uint8"))
+			cellType = MAP_CELL_UINT8;
+		else {
+			fprintf(stderr, "Unknown argument %s\n", arg);
+			return -1;
+		}
+		i++;
+	}
+	if (width < 2 || height < 2 || numFrames < 1 || numWarmupFrames < 0) {
+		fprintf(stderr, "Invalid resolution or frame count\n");
+		return -1;
+	}
+	FILE *out = outputFile ? fopen(outputFile, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "Couldn't open %s\n", outputFile);
+		return -1;
+	}
+	if (benchmarkDDA) {
+		runDDABenchmark(out, cellType);
+		if (out != stdout)
+			fclose(out);
+		return 0;
+	}
+
+	Image *textures[] = {
+			new Image("assets/STARG2.png"),
+			new Image("assets/STARG3.png"),
+			new Image("assets/STARGR2.png"),
+			new Image("assets/TEKWALL1.png"),
+			new Image("assets/TEKWALL2.png"),
+			new Image("assets/TEKWALL3.png"),
+			new Image("assets/TEKWALL4.png"),
+	};
+	for (int32_t i = 0; i < int32_t(sizeof(textures) / sizeof(Image *)); i++) {
+		if (!textures[i]->pixels) {
+			fprintf(stderr, "Couldn't load textures, run from the directory containing assets/\n");
+			return -1;
+		}
+	}
+	Image grunt("assets/grunt.png");
+	grunt.createPosts();
+	Renderer renderer(width, height, textures, sizeof(textures) / sizeof(Image *), textures[1], textures[2]);
+	renderer.useFixedPoint = useFixedPoint;
+	renderer.useMipmaps = useMipmaps;
+	renderer.setNumThreads(numThreads);
+	if (checkGrid) {
+		int32_t numMismatches = checkSpriteGrid(out, renderer, &grunt, cellType);
+		if (out != stdout)
+			fclose(out);
+		return numMismatches ? 1 : 0;
+	}
+
+	Scene scenes[3];
+	Scene &demo = scenes[0];
+	demo.name = "demo";
+	demo.map = new Map(21, 21, cellType, demoCells);
+	demo.sprites = new Sprite *[3];
+	demo.sprites[0] = new Sprite(3.5f, 2.5f, 0.7f, &grunt);
+	demo.sprites[1] = new Sprite(4.5f, 1.5f, 0.7f, &grunt);
+	demo.sprites[2] = new Sprite(5.5f, 2.0f, 0.7f, &grunt);
+	demo.numSprites = 3;
+	if (pathFile) {
+		demo.poses = loadPath(pathFile, demo.numPoses);
+		if (!demo.poses || !demo.numPoses) {
+			fprintf(stderr, "Couldn't load camera path %s\n", pathFile);
+			return -1;
+		}
+	} else {
+		const float waypoints[] = {2.5f, 2.5f, 18.5f, 2.5f, 18.5f, 18.5f, 11.5f, 12.5f,
+								   2.5f, 18.5f, 2.5f, 7.5f, 6.5f, 7.5f, 6.5f, 2.5f, 2.5f, 2.5f};
+		demo.poses = createPath(waypoints, sizeof(waypoints) / sizeof(float) / 2, numFrames);
+		demo.numPoses = numFrames;
+	}
+	scenes[1] = createGeneratedScene("generated_64", 64, numFrames, &grunt, cellType);
+	scenes[2] = createGeneratedScene("generated_256", 256, numFrames, &grunt, cellType);
+
+	fprintf(out, "{\n  \"width\": %i,\n  \"height\": %i,\n  \"threads\": %i,\n  \"fixedPoint\": %s,\n"
+				 "  \"mipmaps\": %s,\n  \"spriteGrid\": %s,\n  \"scenes\": [\n",
+			width, height, renderer.getNumThreads(), useFixedPoint ? "true" : "false",
+			useMipmaps ? "true" : "false", useSpriteGrid ? "true" : "false");
+	int32_t numScenes = sizeof(scenes) / sizeof(Scene);
+	for (int32_t i = 0; i < numScenes; i++) {
+		Scene &scene = scenes[i];
+		double *total = new double[scene.numPoses];
+		double *walls = new double[scene.numPoses];
+		double *floorAndCeiling = new double[scene.numPoses];
+		double *sprites = new double[scene.numPoses];
+		double *spriteSort = new double[scene.numPoses];
+		RenderStats sum = RenderStats();
+		SpriteGrid grid(scene.map->width, scene.map->height);
+		grid.update(scene.sprites, scene.numSprites);
+		for (int32_t j = -numWarmupFrames; j < scene.numPoses; j++) {
+			Pose &pose = scene.poses[j < 0 ? 0 : j];
+			Camera camera(pose.x, pose.y, pose.angle, 66);
+			if (useSpriteGrid)
+				renderer.render(camera, *scene.map, grid, 6);
+			else
+				renderer.render(camera, *scene.map, scene.sprites, scene.numSprites, 6);
+			if (renderer.stats.totalTime == 0) {
+				fprintf(stderr, "No stats collected, compile lilray.cpp with LILRAY_ENABLE_STATS\n");
+				return -1;
+			}
+			if (j < 0)
+				continue;
+			RenderStats &stats = renderer.stats;
+			total[j] = stats.totalTime;
+			walls[j] = stats.wallsTime;
+			floorAndCeiling[j] = stats.floorAndCeilingTime;
+			sprites[j] = stats.spritesTime;
+			spriteSort[j] = stats.spriteSortTime;
+			sum.raysCast += stats.raysCast;
+			sum.ddaSteps += stats.ddaSteps;
+			sum.floorAndCeilingPixels += stats.floorAndCeilingPixels;
+			sum.wallPixels += stats.wallPixels;
+			sum.spritePixels += stats.spritePixels;
+			sum.spritesCulled += stats.spritesCulled;
+			sum.spritesDrawn += stats.spritesDrawn;
+			sum.spritesSorted += stats.spritesSorted;
+			sum.overdraw += stats.overdraw;
+		}
+		double n = scene.numPoses;
+		fprintf(out, "    {\n      \"name\": \"%s\",\n      \"mapWidth\": %i,\n      \"mapHeight\": %i,\n"
+					 "      \"sprites\": %i,\n      \"frames\": %i,\n      \"stages\": {\n",
+				scene.name, scene.map->width, scene.map->height, scene.numSprites, scene.numPoses);
+		writeStage(out, "total", total, scene.numPoses, false);
+		writeStage(out, "walls", walls, scene.numPoses, false);
+		writeStage(out, "floorAndCeiling", floorAndCeiling, scene.numPoses, false);
+		writeStage(out, "sprites", sprites, scene.numPoses, false);
+		writeStage(out, "spriteSort", spriteSort, scene.numPoses, true);
+		fprintf(out, "      },\n      \"averages\": {\n");
+		fprintf(out, "        \"raysCast\": %.1f,\n        \"ddaSteps\": %.1f,\n", sum.raysCast / n, sum.ddaSteps / n);
+		fprintf(out, "        \"floorAndCeilingPixels\": %.1f,\n        \"wallPixels\": %.1f,\n",
+				sum.floorAndCeilingPixels / n, sum.wallPixels / n);
+		fprintf(out, "        \"spritePixels\": %.1f,\n        \"spritesCulled\": %.2f,\n", sum.spritePixels / n,
+				sum.spritesCulled / n);
+		fprintf(out, "        \"spritesDrawn\": %.2f,\n        \"spritesSorted\": %.2f,\n", sum.spritesDrawn / n,
+				sum.spritesSorted / n);
+		fprintf(out, "        \"overdraw\": %.3f\n", sum.overdraw / n);
+		fprintf(out, "      }\n    }%s\n", i < numScenes - 1 ? "," : "");
+		delete[] total;
+		delete[] walls;
+		delete[] floorAndCeiling;
+		delete[] sprites;
+		delete[] spriteSort;
+	}
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
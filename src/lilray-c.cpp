@@ -7,6 +7,10 @@ lilray_image lilray_image_create(int32_t width, int32_t height, uint32_t *pixels
     return (lilray_image) new Image(width, height, pixels);
 }
 
+lilray_image lilray_image_create_view(int32_t width, int32_t height, uint32_t *pixels) {
+    return (lilray_image) new Image(width, height, pixels, false);
+}
+
 lilray_image lilray_image_create_from_file(const char *file) {
     return (lilray_image) new Image(file);
 }
@@ -17,7 +21,7 @@ FFI_EXPORT lilray_image lilray_image_create_from_memory(uint8_t *data, int32_t n
 
 void lilray_image_dispose(lilray_image texture) {
     if (!texture) return;
-    delete texture;
+    delete (Image *) texture;
 }
 
 int32_t lilray_image_get_width(lilray_image texture) {
@@ -56,10 +60,38 @@ void lilray_image_to_rgba(lilray_image image) {
     ((Image *) image)->reverseColorChannels();
 }
 
+void lilray_image_create_posts(lilray_image image) {
+    if (!image) return;
+    ((Image *) image)->createPosts();
+}
+
+lilray_thread_pool lilray_thread_pool_create(int32_t num_threads) {
+    return (lilray_thread_pool) new ThreadPool(num_threads);
+}
+
+void lilray_thread_pool_dispose(lilray_thread_pool thread_pool) {
+    if (!thread_pool) return;
+    delete (ThreadPool *) thread_pool;
+}
+
 lilray_map lilray_map_create(int32_t width, int32_t height, int32_t *cells) {
     return (lilray_map) new Map(width, height, cells);
 }
 
+lilray_map lilray_map_create_with_cell_type(int32_t width, int32_t height, int32_t *cells,
+                                            lilray_map_cell_type cell_type) {
+    return (lilray_map) new Map(width, height, (MapCellType) cell_type, cells);
+}
+
+lilray_map lilray_map_create_with_layout(int32_t width, int32_t height, int32_t *cells,
+                                         lilray_map_cell_type cell_type, lilray_map_layout layout) {
+    return (lilray_map) new Map(width, height, (MapCellType) cell_type, cells, (MapLayout) layout);
+}
+
+lilray_map lilray_map_create_view(int32_t width, int32_t height, int32_t *cells) {
+    return (lilray_map) new Map(width, height, cells, false);
+}
+
 void lilray_map_dispose(lilray_map map) {
     delete (Map *) map;
 }
@@ -74,7 +106,12 @@ int32_t lilray_map_get_height(lilray_map map) {
     return ((Map *) map)->height;
 }
 
-int32_t *lilray_map_get_cells(lilray_map map) {
+lilray_map_cell_type lilray_map_get_cell_type(lilray_map map) {
+    if (!map) return LILRAY_MAP_CELL_INT32;
+    return (lilray_map_cell_type) ((Map *) map)->cellType;
+}
+
+void *lilray_map_get_cells(lilray_map map) {
     if (!map) return nullptr;
     return ((Map *) map)->cells;
 }
@@ -89,6 +126,20 @@ int32_t lilray_map_get_cell(lilray_map map, int32_t x, int32_t y) {
     return ((Map *) map)->getCell(x, y);
 }
 
+void lilray_map_create_distance_field(lilray_map map) {
+    if (!map) return;
+    ((Map *) map)->createDistanceField();
+}
+
+void lilray_map_raycast_batch(lilray_map map, int32_t num_rays, const float *ray_x, const float *ray_y,
+                              const float *ray_dir_x, const float *ray_dir_y, const float *max_distance,
+                              int32_t *cells, float *hit_x, float *hit_y, float *distance,
+                              lilray_thread_pool thread_pool) {
+    if (!map) return;
+    ((Map *) map)->raycastBatch(num_rays, ray_x, ray_y, ray_dir_x, ray_dir_y, max_distance, cells, hit_x, hit_y,
+                                distance, (ThreadPool *) thread_pool);
+}
+
 lilray_camera lilray_camera_create(float x, float y, float angle, float field_of_view) {
     return (lilray_camera) new Camera(x, y, angle, field_of_view);
 }
@@ -198,6 +249,20 @@ void lilray_sprite_set_image(lilray_sprite sprite, lilray_image *image) {
     ((Sprite *) sprite)->image = (Image *) image;
 }
 
+lilray_sprite_grid lilray_sprite_grid_create(int32_t width, int32_t height) {
+    return (lilray_sprite_grid) new SpriteGrid(width, height);
+}
+
+void lilray_sprite_grid_dispose(lilray_sprite_grid grid) {
+    if (!grid) return;
+    delete (SpriteGrid *) grid;
+}
+
+void lilray_sprite_grid_update(lilray_sprite_grid grid, lilray_sprite *sprites, int32_t num_sprites) {
+    if (!grid) return;
+    ((SpriteGrid *) grid)->update((Sprite **) sprites, num_sprites);
+}
+
 lilray_renderer lilray_renderer_create(int32_t width, int32_t height, lilray_image *wall_textures,
                                        int32_t num_wall_textures, lilray_image floor_texture,
                                        lilray_image ceiling_texture) {
@@ -208,7 +273,7 @@ lilray_renderer lilray_renderer_create(int32_t width, int32_t height, lilray_ima
 
 void lilray_renderer_dispose(lilray_renderer renderer) {
     if (!renderer) return;
-    delete renderer;
+    delete (Renderer *) renderer;
 }
 
 lilray_image lilray_renderer_get_frame(lilray_renderer renderer) {
@@ -217,8 +282,84 @@ lilray_image lilray_renderer_get_frame(lilray_renderer renderer) {
     return (lilray_image) frame;
 }
 
+void lilray_renderer_set_num_threads(lilray_renderer renderer, int32_t num_threads) {
+    if (!renderer) return;
+    ((Renderer *) renderer)->setNumThreads(num_threads);
+}
+
+int32_t lilray_renderer_get_num_threads(lilray_renderer renderer) {
+    if (!renderer) return 0;
+    return ((Renderer *) renderer)->getNumThreads();
+}
+
+void lilray_renderer_set_render_target(lilray_renderer renderer, uint32_t *pixels, int32_t width,
+                                       int32_t height, int32_t pitch, lilray_pixel_format format) {
+    if (!renderer) return;
+    ((Renderer *) renderer)->setRenderTarget(pixels, width, height, pitch, (PixelFormat) format);
+}
+
+void lilray_renderer_get_stats(lilray_renderer renderer, lilray_render_stats *stats) {
+    if (!renderer || !stats) return;
+    RenderStats &src = ((Renderer *) renderer)->stats;
+    stats->floor_and_ceiling_time = src.floorAndCeilingTime;
+    stats->walls_time = src.wallsTime;
+    stats->sprites_time = src.spritesTime;
+    stats->sprite_sort_time = src.spriteSortTime;
+    stats->total_time = src.totalTime;
+    stats->rays_cast = src.raysCast;
+    stats->dda_steps = src.ddaSteps;
+    stats->floor_and_ceiling_pixels = src.floorAndCeilingPixels;
+    stats->wall_pixels = src.wallPixels;
+    stats->sprite_pixels = src.spritePixels;
+    stats->sprites_culled = src.spritesCulled;
+    stats->sprites_drawn = src.spritesDrawn;
+    stats->sprites_sorted = src.spritesSorted;
+    stats->overdraw = src.overdraw;
+}
+
 void lilray_renderer_render(lilray_renderer renderer, lilray_camera camera, lilray_map map, lilray_sprite *sprites,
                             int num_sprites, float light_distance) {
     if (!renderer) return;
     ((Renderer *) renderer)->render(*(Camera *) camera, *(Map *) map, (Sprite **) sprites, num_sprites, light_distance);
 }
+
+void lilray_renderer_render_grid(lilray_renderer renderer, lilray_camera camera, lilray_map map,
+                                 lilray_sprite_grid sprites, float light_distance) {
+    if (!renderer || !sprites) return;
+    ((Renderer *) renderer)->render(*(Camera *) camera, *(Map *) map, *(SpriteGrid *) sprites, light_distance);
+}
+
+void lilray_renderer_render_views(lilray_renderer renderer, int32_t num_views, lilray_camera *cameras,
+                                  lilray_image *frames, lilray_map map, lilray_sprite *sprites, int num_sprites,
+                                  float light_distance) {
+    if (!renderer || !cameras || !frames) return;
+    ((Renderer *) renderer)->renderViews(num_views, (Camera **) cameras, (Image **) frames, *(Map *) map,
+                                         (Sprite **) sprites, num_sprites, light_distance);
+}
+
+lilray_render_pipeline lilray_render_pipeline_create(lilray_renderer renderer, int32_t num_buffers) {
+    if (!renderer) return nullptr;
+    return (lilray_render_pipeline) new RenderPipeline((Renderer *) renderer, num_buffers);
+}
+
+void lilray_render_pipeline_dispose(lilray_render_pipeline pipeline) {
+    if (!pipeline) return;
+    delete (RenderPipeline *) pipeline;
+}
+
+void lilray_render_pipeline_submit(lilray_render_pipeline pipeline, lilray_camera camera, lilray_map map,
+                                   lilray_sprite *sprites, int32_t num_sprites, float light_distance) {
+    if (!pipeline) return;
+    ((RenderPipeline *) pipeline)->submit(*(Camera *) camera, *(Map *) map, (Sprite **) sprites, num_sprites,
+                                          light_distance);
+}
+
+lilray_image lilray_render_pipeline_acquire(lilray_render_pipeline pipeline, int32_t wait) {
+    if (!pipeline) return nullptr;
+    return (lilray_image) ((RenderPipeline *) pipeline)->acquire(wait != 0);
+}
+
+void lilray_render_pipeline_finish(lilray_render_pipeline pipeline) {
+    if (!pipeline) return;
+    ((RenderPipeline *) pipeline)->finish();
+}
@@ -32,6 +32,8 @@
 
 FFI_OPAQUE_TYPE(lilray_image)
 FFI_EXPORT lilray_image lilray_image_create(int32_t width, int32_t height, uint32_t *pixels);
+// Uses pixels without copying, they have to outlive the image.
+FFI_EXPORT lilray_image lilray_image_create_view(int32_t width, int32_t height, uint32_t *pixels);
 FFI_EXPORT lilray_image lilray_image_create_from_file(const char *file);
 FFI_EXPORT lilray_image lilray_image_create_from_memory(uint8_t *data, int32_t num_bytes);
 FFI_EXPORT void lilray_image_dispose(lilray_image image);
@@ -44,15 +46,56 @@ FFI_EXPORT void lilray_image_clear(lilray_image image, uint32_t argb_color);
 FFI_EXPORT void lilray_image_vertical_line(lilray_image image, int32_t x, int32_t y_start, int32_t y_end,
                                            uint32_t argb_color);
 FFI_EXPORT void lilray_image_to_rgba(lilray_image image);
+// Lets sprites using the image skip transparent texels, see lilray::Image::createPosts().
+FFI_EXPORT void lilray_image_create_posts(lilray_image image);
+
+// num_threads <= 0 uses one thread per hardware core, see lilray::ThreadPool.
+FFI_OPAQUE_TYPE(lilray_thread_pool)
+FFI_EXPORT lilray_thread_pool lilray_thread_pool_create(int32_t num_threads);
+FFI_EXPORT void lilray_thread_pool_dispose(lilray_thread_pool thread_pool);
+
+// See lilray::MapCellType.
+typedef enum lilray_map_cell_type {
+    LILRAY_MAP_CELL_INT32,
+    LILRAY_MAP_CELL_UINT16,
+    LILRAY_MAP_CELL_UINT8
+} lilray_map_cell_type;
+
+// See lilray::MapLayout.
+typedef enum lilray_map_layout {
+    LILRAY_MAP_LAYOUT_ROW_MAJOR,
+    LILRAY_MAP_LAYOUT_TILED,
+    LILRAY_MAP_LAYOUT_MORTON
+} lilray_map_layout;
 
 FFI_OPAQUE_TYPE(lilray_map)
 FFI_EXPORT lilray_map lilray_map_create(int32_t width, int32_t height, int32_t *cells);
+// Copies cells, converting them to cell_type.
+FFI_EXPORT lilray_map lilray_map_create_with_cell_type(int32_t width, int32_t height, int32_t *cells,
+                                                       lilray_map_cell_type cell_type);
+// Copies row major cells, converting them to cell_type and layout.
+FFI_EXPORT lilray_map lilray_map_create_with_layout(int32_t width, int32_t height, int32_t *cells,
+                                                    lilray_map_cell_type cell_type, lilray_map_layout layout);
+// Uses cells without copying, they have to outlive the map.
+FFI_EXPORT lilray_map lilray_map_create_view(int32_t width, int32_t height, int32_t *cells);
 FFI_EXPORT void lilray_map_dispose(lilray_map map);
 FFI_EXPORT int32_t lilray_map_get_width(lilray_map map);
 FFI_EXPORT int32_t lilray_map_get_height(lilray_map map);
-FFI_EXPORT int32_t *lilray_map_get_cells(lilray_map map);
+FFI_EXPORT lilray_map_cell_type lilray_map_get_cell_type(lilray_map map);
+// int32_t, uint16_t or uint8_t per cell, see lilray_map_get_cell_type(), in the
+// map's layout.
+FFI_EXPORT void *lilray_map_get_cells(lilray_map map);
 FFI_EXPORT void lilray_map_set_cell(lilray_map map, int32_t x, int32_t y, int32_t value);
 FFI_EXPORT int32_t lilray_map_get_cell(lilray_map map, int32_t x, int32_t y);
+// Lets raycasts leap over empty space, lilray_map_set_cell() keeps it up to
+// date. Call again after writing to lilray_map_get_cells() directly.
+FFI_EXPORT void lilray_map_create_distance_field(lilray_map map);
+// Casts num_rays rays with a single call, ray i stops at max_distance[i].
+// cells[i] is 0 if ray i did not hit anything. thread_pool may be NULL.
+FFI_EXPORT void lilray_map_raycast_batch(lilray_map map, int32_t num_rays, const float *ray_x, const float *ray_y,
+                                         const float *ray_dir_x, const float *ray_dir_y, const float *max_distance,
+                                         int32_t *cells, float *hit_x, float *hit_y, float *distance,
+                                         lilray_thread_pool thread_pool);
 
 FFI_OPAQUE_TYPE(lilray_camera)
 FFI_EXPORT lilray_camera lilray_camera_create(float x, float y, float angle, float field_of_view);
@@ -80,13 +123,65 @@ FFI_EXPORT void lilray_sprite_set_height(lilray_sprite sprite, float height);
 FFI_EXPORT lilray_image lilray_sprite_get_image(lilray_sprite sprite);
 FFI_EXPORT void lilray_sprite_set_image(lilray_sprite sprite, lilray_image image);
 
+FFI_OPAQUE_TYPE(lilray_sprite_grid)
+FFI_EXPORT lilray_sprite_grid lilray_sprite_grid_create(int32_t width, int32_t height);
+FFI_EXPORT void lilray_sprite_grid_dispose(lilray_sprite_grid grid);
+FFI_EXPORT void lilray_sprite_grid_update(lilray_sprite_grid grid, lilray_sprite *sprites, int32_t num_sprites);
+
+// See lilray::RenderStats.
+typedef struct lilray_render_stats {
+    double floor_and_ceiling_time;
+    double walls_time;
+    double sprites_time;
+    double sprite_sort_time;
+    double total_time;
+    int64_t rays_cast;
+    int64_t dda_steps;
+    int64_t floor_and_ceiling_pixels;
+    int64_t wall_pixels;
+    int64_t sprite_pixels;
+    int32_t sprites_culled;
+    int32_t sprites_drawn;
+    int32_t sprites_sorted;
+    float overdraw;
+} lilray_render_stats;
+
+// See lilray::PixelFormat.
+typedef enum lilray_pixel_format {
+    LILRAY_PIXEL_FORMAT_ARGB,
+    LILRAY_PIXEL_FORMAT_ABGR,
+    LILRAY_PIXEL_FORMAT_RGBA
+} lilray_pixel_format;
+
 FFI_OPAQUE_TYPE(lilray_renderer)
 FFI_EXPORT lilray_renderer lilray_renderer_create(int32_t width, int32_t height, lilray_image *wall_textures,
                                                   int32_t num_wall_textures, lilray_image floor_texture,
                                                   lilray_image ceiling_texture);
 FFI_EXPORT void lilray_renderer_dispose(lilray_renderer renderer);
 FFI_EXPORT lilray_image lilray_renderer_get_frame(lilray_renderer renderer);
+FFI_EXPORT void lilray_renderer_set_num_threads(lilray_renderer renderer, int32_t num_threads);
+FFI_EXPORT int32_t lilray_renderer_get_num_threads(lilray_renderer renderer);
+FFI_EXPORT void lilray_renderer_set_render_target(lilray_renderer renderer, uint32_t *pixels, int32_t width,
+                                                  int32_t height, int32_t pitch, lilray_pixel_format format);
+FFI_EXPORT void lilray_renderer_get_stats(lilray_renderer renderer, lilray_render_stats *stats);
 FFI_EXPORT void
 lilray_renderer_render(lilray_renderer renderer, lilray_camera camera, lilray_map map, lilray_sprite *sprites,
                        int num_sprites, float light_distance);
+FFI_EXPORT void lilray_renderer_render_grid(lilray_renderer renderer, lilray_camera camera, lilray_map map,
+                                            lilray_sprite_grid sprites, float light_distance);
+// Renders cameras[i] into frames[i] for each of the num_views views, see
+// lilray::Renderer::renderViews(). All frames must have the same format,
+// nothing is rendered otherwise.
+FFI_EXPORT void lilray_renderer_render_views(lilray_renderer renderer, int32_t num_views, lilray_camera *cameras,
+                                             lilray_image *frames, lilray_map map, lilray_sprite *sprites,
+                                             int num_sprites, float light_distance);
+
+// See lilray::RenderPipeline. acquire returns NULL if no frame is ready.
+FFI_OPAQUE_TYPE(lilray_render_pipeline)
+FFI_EXPORT lilray_render_pipeline lilray_render_pipeline_create(lilray_renderer renderer, int32_t num_buffers);
+FFI_EXPORT void lilray_render_pipeline_dispose(lilray_render_pipeline pipeline);
+FFI_EXPORT void lilray_render_pipeline_submit(lilray_render_pipeline pipeline, lilray_camera camera, lilray_map map,
+                                              lilray_sprite *sprites, int32_t num_sprites, float light_distance);
+FFI_EXPORT lilray_image lilray_render_pipeline_acquire(lilray_render_pipeline pipeline, int32_t wait);
+FFI_EXPORT void lilray_render_pipeline_finish(lilray_render_pipeline pipeline);
 #endif
@@ -2,8 +2,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <lilray.h>
 
+#if defined(DJGPP) || (defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__))
+#define LILRAY_NO_THREADS
+#endif
+
+#ifndef LILRAY_NO_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#ifdef LILRAY_ENABLE_STATS
+#include <chrono>
+#define LILRAY_STATS(...) __VA_ARGS__
+#else
+#define LILRAY_STATS(...)
+#endif
+
+#ifndef LILRAY_NO_SIMD
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LILRAY_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LILRAY_AVX2
+#define LILRAY_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+static bool cpuSupportsAVX2() {
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+}
+#elif defined(__GNUC__) && !defined(__EMSCRIPTEN__)
+#define LILRAY_AVX2
+#define LILRAY_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+static bool cpuSupportsAVX2() { return __builtin_cpu_supports("avx2"); }
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LILRAY_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_NO_HDR
 #define STBI_NO_LINEAR
@@ -20,6 +72,10 @@ using namespace lilray;
 #define PIXEL_FP_ONE (1 << 6)
 #define TEXEL_FP_BITS 16
 #define FLOOR_FP_BITS 13
+#define WORLD_FP_BITS 16
+#define WORLD_FP_ONE (1 << 16)
+// Entries of the fixed point sine table per full turn.
+#define SINE_TABLE_BITS 12
 
 static inline float signum(float v) { return v < 0 ? -1.0f : 1.0f; }
 
@@ -28,21 +84,90 @@ static inline float fmin(float a, float b) { return a < b ? a : b; }
 static inline float fmax(float a, float b) { return a > b ? a : b; }
 #endif
 
-static inline uint32_t darken(uint32_t color, uint8_t lightness) {
-	uint64_t expand = (((uint64_t) color) << 32) | color;
+// Scales all channels but the one in alphaMask. Spreads the four bytes into
+// 16-bit slots, so a single multiply shades them all.
+static inline uint32_t darken(uint32_t color, uint8_t lightness, uint32_t alphaMask = 0xFF000000) {
+	uint64_t expand = (((uint64_t) color) << 24) | color;
 	uint64_t x =
-			(((expand & 0x0000FF0000FF00FF) * lightness) >> 8) & 0x0000FF0000FF00FF;
-	return (uint32_t) ((x >> 32) | x) | (color & 0xFF000000);
+			(((expand & 0x00FF00FF00FF00FF) * lightness) >> 8) & 0x00FF00FF00FF00FF;
+	return ((uint32_t) ((x >> 24) | x) & ~alphaMask) | (color & alphaMask);
+}
+
+static inline uint32_t getAlphaMask(PixelFormat format) {
+	return format == PIXEL_FORMAT_RGBA ? 0x000000FF : 0xFF000000;
+}
+
+static inline uint32_t convertColor(uint32_t color, PixelFormat from, PixelFormat to) {
+	if (from == to)
+		return color;
+	if (from == PIXEL_FORMAT_ABGR)
+		color = (color & 0xFF00FF00) | ((color >> 16) & 0xFF) | ((color & 0xFF) << 16);
+	else if (from == PIXEL_FORMAT_RGBA)
+		color = (color >> 8) | (color << 24);
+	if (to == PIXEL_FORMAT_ABGR)
+		color = (color & 0xFF00FF00) | ((color >> 16) & 0xFF) | ((color & 0xFF) << 16);
+	else if (to == PIXEL_FORMAT_RGBA)
+		color = (color << 8) | (color >> 24);
+	return color;
 }
 
+// Texel sources for the slice, span and sprite drawers. get(i) returns the
+// shaded texel at index i, either darkened true color or looked up in one
+// of the palette's color maps.
+struct ShadedTexels {
+	const uint32_t *pixels;
+	int32_t stride;
+	uint8_t lightness;
+	uint32_t alphaMask;
+
+	bool isTransparent(uint32_t i) const { return !pixels[i * stride]; }
+
+	uint32_t get(uint32_t i) const { return darken(pixels[i * stride], lightness, alphaMask); }
+};
+
+// Texels in another format than the frame, e.g. sprite images shared with
+// renderers of other formats.
+struct ConvertedTexels {
+	const uint32_t *pixels;
+	int32_t stride;
+	uint8_t lightness;
+	PixelFormat from, to;
+
+	bool isTransparent(uint32_t i) const { return !pixels[i * stride]; }
+
+	uint32_t get(uint32_t i) const {
+		return convertColor(darken(pixels[i * stride], lightness, getAlphaMask(from)), from, to);
+	}
+};
+
+struct PaletteTexels {
+	const uint8_t *indices;
+	int32_t stride;
+	const uint32_t *colorMap;
+
+	bool isTransparent(uint32_t i) const { return !indices[i * stride]; }
+
+	uint32_t get(uint32_t i) const { return colorMap[indices[i * stride]]; }
+};
+
 static inline float distance(float x1, float y1, float x2, float y2) {
 	float dx = x2 - x1, dy = y2 - y1;
 	return sqrtf(dx * dx + dy * dy);
 }
 
-static int spriteCompare(const void *a, const void *b) {
-	return int(signum((*(Sprite **) b)->distance - (*(Sprite **) a)->distance));
-}
+// A sprite that passed culling, projected to the screen rectangle drawSprite()
+// expects. The rectangle is in PIXEL_FP_BITS fixed point, with the top/left
+// corner rounded to stabilize the sprite on screen.
+struct lilray::VisibleSprite {
+	Sprite *sprite;
+	int32_t minX, minY, maxX, maxY;
+	// Depth along the view direction, float and fixed point in WORLD_FP_BITS.
+	float depth;
+	int32_t depthFixedPoint;
+	// Grows with the distance to the camera. The bits of the float distance,
+	// or the squared fixed point distance.
+	uint64_t sortKey;
+};
 
 static inline int32_t floatToFixed(float v, int32_t bits) {
 	return int32_t(v * (1 << bits));
@@ -64,26 +189,350 @@ static inline int32_t fixedMultiply(int32_t a, int32_t b, int32_t bits) {
 	return int32_t((int64_t(a) * int64_t(b)) >> bits);
 }
 
-Image::Image(const char *imageFile) {
-	pixels = (uint32_t *) stbi_load(imageFile, (int *) &width, (int *) &height,
-									nullptr, 4);
+static inline int32_t fixedSquareRoot(int64_t v) {
+	int64_t root = 0;
+	for (int64_t bit = int64_t(1) << 62; bit; bit >>= 2) {
+		if (v >= root + bit) {
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+	return int32_t(root);
+}
+
+// sin() in WORLD_FP_BITS for angles in 1 / (1 << SINE_TABLE_BITS) turns, so the
+// fixed point render path doesn't need any trigonometric functions.
+static int32_t sineTable[1 << SINE_TABLE_BITS];
+
+static bool buildSineTable() {
+	for (int32_t i = 0; i < (1 << SINE_TABLE_BITS); i++)
+		sineTable[i] = int32_t(floorf(sinf(float(i) * 360.0f / (1 << SINE_TABLE_BITS) * DEG_TO_RAD) * WORLD_FP_ONE + 0.5f));
+	return true;
+}
+
+static const bool isSineTableBuilt = buildSineTable();
+
+static inline int32_t fixedSine(int32_t angle) { return sineTable[angle & ((1 << SINE_TABLE_BITS) - 1)]; }
+
+static inline int32_t fixedCosine(int32_t angle) { return fixedSine(angle + (1 << (SINE_TABLE_BITS - 2))); }
+
+// The camera in WORLD_FP_BITS. The fixed point passes convert the camera once
+// per frame and use integer math only from there on.
+struct FixedPointCamera {
+	int32_t x, y;
+	int32_t dirX, dirY, rightX, rightY;
+	int32_t lightDistance;
+};
+
+static FixedPointCamera getFixedPointCamera(Camera &camera, float lightDistance) {
+	FixedPointCamera fixedCamera;
+	int32_t angle = int32_t(floorf(camera.angle / 360.0f * (1 << SINE_TABLE_BITS) + 0.5f));
+	fixedCamera.x = floatToFixed(camera.x, WORLD_FP_BITS);
+	fixedCamera.y = floatToFixed(camera.y, WORLD_FP_BITS);
+	fixedCamera.dirX = fixedCosine(angle);
+	fixedCamera.dirY = fixedSine(angle);
+	fixedCamera.rightX = -fixedCamera.dirY;
+	fixedCamera.rightY = fixedCamera.dirX;
+	fixedCamera.lightDistance = floatToFixed(lightDistance, WORLD_FP_BITS);
+	if (fixedCamera.lightDistance < 1)
+		fixedCamera.lightDistance = 1;
+	return fixedCamera;
+}
+
+// 255 * min(distance, lightDistance) / lightDistance, how much to darken
+// something at distance.
+static inline int32_t getDarknessFixedPoint(int32_t distance, int32_t lightDistance) {
+	return int32_t(int64_t(distance < lightDistance ? distance : lightDistance) * 255 / lightDistance);
+}
+
+// Owned pixels are allocated with new[], stb_image allocates with malloc.
+static uint32_t *copyLoadedPixels(stbi_uc *data, int32_t &width, int32_t &height) {
+	if (!data) {
+		width = height = 0;
+		return nullptr;
+	}
+	uint32_t *pixels = new uint32_t[width * height];
+	memcpy(pixels, data, sizeof(uint32_t) * width * height);
+	stbi_image_free(data);
+	return pixels;
+}
+
+Image::Image(const char *imageFile)
+	: format(PIXEL_FORMAT_ARGB), ownsPixels(true), columnPixels(nullptr), indices(nullptr), columnIndices(nullptr),
+	  mipmaps(nullptr), numMipmaps(0), posts(nullptr), postStarts(nullptr) {
+	stbi_uc *data = stbi_load(imageFile, (int *) &width, (int *) &height, nullptr, 4);
+	pixels = copyLoadedPixels(data, width, height);
+	pitch = width;
 	reverseColorChannels();
 }
 
-Image::Image(uint8_t *imageBytes, int32_t numBytes) {
-	pixels = (uint32_t *) stbi_load_from_memory(
-			imageBytes, numBytes, (int *) &width, (int *) &height, nullptr, 4);
+Image::Image(uint8_t *imageBytes, int32_t numBytes)
+	: format(PIXEL_FORMAT_ARGB), ownsPixels(true), columnPixels(nullptr), indices(nullptr), columnIndices(nullptr),
+	  mipmaps(nullptr), numMipmaps(0), posts(nullptr), postStarts(nullptr) {
+	stbi_uc *data = stbi_load_from_memory(imageBytes, numBytes, (int *) &width, (int *) &height, nullptr, 4);
+	pixels = copyLoadedPixels(data, width, height);
+	pitch = width;
 	reverseColorChannels();
 }
 
 Image::Image(int32_t width, int32_t height, const uint32_t *pixels)
-	: width(width), height(height) {
+	: width(width), height(height), pitch(width), format(PIXEL_FORMAT_ARGB), ownsPixels(true),
+	  columnPixels(nullptr), indices(nullptr), columnIndices(nullptr),
+	  mipmaps(nullptr), numMipmaps(0), posts(nullptr), postStarts(nullptr) {
 	this->pixels = new uint32_t[width * height];
 	if (pixels)
 		memcpy(this->pixels, pixels, sizeof(uint32_t) * width * height);
 }
 
-Image::~Image() { delete pixels; }
+Image::Image(int32_t width, int32_t height, uint32_t *pixels, bool ownsPixels)
+	: width(width), height(height), pitch(width), format(PIXEL_FORMAT_ARGB), ownsPixels(ownsPixels),
+	  pixels(pixels), columnPixels(nullptr), indices(nullptr), columnIndices(nullptr),
+	  mipmaps(nullptr), numMipmaps(0), posts(nullptr), postStarts(nullptr) {
+}
+
+Image::~Image() {
+	if (ownsPixels)
+		delete[] pixels;
+	delete[] columnPixels;
+	delete[] indices;
+	delete[] columnIndices;
+	for (int32_t i = 0; i < numMipmaps; i++)
+		delete mipmaps[i];
+	delete[] mipmaps;
+	delete[] posts;
+	delete[] postStarts;
+}
+
+void Image::createColumnPixels() {
+	if (!columnPixels)
+		columnPixels = new uint32_t[width * height];
+	uint32_t *dst = columnPixels;
+	for (int32_t x = 0; x < width; x++) {
+		uint32_t *src = pixels + x;
+		for (int32_t y = 0; y < height; y++, src += pitch)
+			*dst++ = *src;
+	}
+	for (int32_t i = 0; i < numMipmaps; i++)
+		mipmaps[i]->createColumnPixels();
+}
+
+void Image::createPosts() {
+	if (!postStarts)
+		postStarts = new int32_t[width + 1];
+	int32_t numPosts = 0;
+	for (int32_t x = 0; x < width; x++) {
+		for (int32_t y = 0; y < height; y++) {
+			if (pixels[x + y * pitch] && (y == 0 || !pixels[x + (y - 1) * pitch]))
+				numPosts++;
+		}
+	}
+	delete[] posts;
+	posts = new int32_t[numPosts * 2];
+	int32_t *post = posts;
+	for (int32_t x = 0; x < width; x++) {
+		postStarts[x] = int32_t(post - posts) / 2;
+		for (int32_t y = 0; y < height; y++) {
+			if (!pixels[x + y * pitch])
+				continue;
+			*post++ = y;
+			while (y < height && pixels[x + y * pitch])
+				y++;
+			*post++ = y;
+		}
+	}
+	postStarts[width] = numPosts;
+}
+
+Image *Image::copy(PixelFormat format) {
+	Image *image = new Image(width, height);
+	image->format = format;
+	for (int32_t y = 0; y < height; y++) {
+		for (int32_t x = 0; x < width; x++)
+			image->pixels[x + y * width] = convertColor(pixels[x + y * pitch], this->format, format);
+	}
+	if (columnPixels)
+		image->createColumnPixels();
+	if (indices) {
+		image->indices = new uint8_t[width * height];
+		memcpy(image->indices, indices, width * height);
+	}
+	if (columnIndices) {
+		image->columnIndices = new uint8_t[width * height];
+		memcpy(image->columnIndices, columnIndices, width * height);
+	}
+	if (numMipmaps) {
+		image->mipmaps = new Image *[numMipmaps];
+		for (int32_t i = 0; i < numMipmaps; i++)
+			image->mipmaps[i] = mipmaps[i]->copy(format);
+		image->numMipmaps = numMipmaps;
+	}
+	if (posts) {
+		image->postStarts = new int32_t[width + 1];
+		memcpy(image->postStarts, postStarts, sizeof(int32_t) * (width + 1));
+		image->posts = new int32_t[postStarts[width] * 2];
+		memcpy(image->posts, posts, sizeof(int32_t) * postStarts[width] * 2);
+	}
+	return image;
+}
+
+void Image::setFormat(PixelFormat format) {
+	if (format == this->format)
+		return;
+	for (int32_t y = 0; y < height; y++) {
+		uint32_t *row = pixels + y * pitch;
+		for (int32_t x = 0; x < width; x++)
+			row[x] = convertColor(row[x], this->format, format);
+	}
+	if (columnPixels) {
+		for (int32_t i = 0, n = width * height; i < n; i++)
+			columnPixels[i] = convertColor(columnPixels[i], this->format, format);
+	}
+	for (int32_t i = 0; i < numMipmaps; i++)
+		mipmaps[i]->setFormat(format);
+	this->format = format;
+}
+
+void Image::quantize(Palette &palette) {
+	if (!indices)
+		indices = new uint8_t[width * height];
+	// Neighbouring texels usually share colors, so cache the nearest palette
+	// entry per 15-bit color. 0 means not looked up yet.
+	uint8_t *nearest = new uint8_t[1 << 15];
+	memset(nearest, 0, 1 << 15);
+	for (int32_t i = 0, n = width * height; i < n; i++) {
+		uint32_t color = convertColor(pixels[i], format, PIXEL_FORMAT_ARGB);
+		if (!color) {
+			indices[i] = 0;
+			continue;
+		}
+		uint32_t key = ((color >> 9) & 0x7c00) | ((color >> 6) & 0x3e0) | ((color >> 3) & 0x1f);
+		if (!nearest[key])
+			nearest[key] = palette.findColor(color);
+		indices[i] = nearest[key];
+	}
+	delete[] nearest;
+
+	if (columnPixels) {
+		if (!columnIndices)
+			columnIndices = new uint8_t[width * height];
+		uint8_t *dst = columnIndices;
+		for (int32_t x = 0; x < width; x++) {
+			for (int32_t y = 0; y < height; y++)
+				*dst++ = indices[x + y * width];
+		}
+	}
+	for (int32_t i = 0; i < numMipmaps; i++)
+		mipmaps[i]->quantize(palette);
+}
+
+// Averages each channel of four pixels, regardless of the channel order.
+static inline uint32_t averageColors(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+	uint32_t lo = (a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) + (d & 0xff00ff) + 0x20002;
+	uint32_t hi = ((a >> 8) & 0xff00ff) + ((b >> 8) & 0xff00ff) + ((c >> 8) & 0xff00ff) + ((d >> 8) & 0xff00ff) +
+				  0x20002;
+	return ((lo >> 2) & 0xff00ff) | (((hi >> 2) & 0xff00ff) << 8);
+}
+
+void Image::createMipmaps() {
+	for (int32_t i = 0; i < numMipmaps; i++)
+		delete mipmaps[i];
+	delete[] mipmaps;
+	numMipmaps = 0;
+	for (int32_t w = width, h = height; w > 1 || h > 1; w = w > 1 ? w >> 1 : 1, h = h > 1 ? h >> 1 : 1)
+		numMipmaps++;
+	mipmaps = numMipmaps ? new Image *[numMipmaps] : nullptr;
+
+	Image *src = this;
+	for (int32_t i = 0; i < numMipmaps; i++) {
+		int32_t w = src->width > 1 ? src->width >> 1 : 1;
+		int32_t h = src->height > 1 ? src->height >> 1 : 1;
+		Image *mipmap = new Image(w, h);
+		mipmap->format = format;
+		// A side that is already 1 texel wide is not halved, so its texel is
+		// averaged with itself.
+		int32_t dx = src->width > 1 ? 1 : 0, dy = src->height > 1 ? src->pitch : 0;
+		for (int32_t y = 0; y < h; y++) {
+			const uint32_t *row = src->pixels + 2 * y * src->pitch;
+			uint32_t *dst = mipmap->pixels + y * mipmap->pitch;
+			for (int32_t x = 0; x < w; x++) {
+				const uint32_t *texel = row + 2 * x;
+				dst[x] = averageColors(texel[0], texel[dx], texel[dy], texel[dx + dy]);
+			}
+		}
+		if (columnPixels)
+			mipmap->createColumnPixels();
+		mipmaps[i] = mipmap;
+		src = mipmap;
+	}
+}
+
+Image *Image::getMipmap(int32_t level) {
+	if (level <= 0 || !numMipmaps)
+		return this;
+	return mipmaps[(level < numMipmaps ? level : numMipmaps) - 1];
+}
+
+TextureAtlas::TextureAtlas(Image **textures, int32_t numTextures, PixelFormat format)
+	: format(format), pixels(nullptr), indices(nullptr),
+	  numTextures(numTextures), numLevels(1), slots(nullptr), block(nullptr) {
+	const int32_t cacheLine = 64, slotAlignment = cacheLine / sizeof(uint32_t);
+	bool hasIndices = numTextures > 0;
+	for (int32_t i = 0; i < numTextures; i++) {
+		if (textures[i] && textures[i]->numMipmaps + 1 > numLevels)
+			numLevels = textures[i]->numMipmaps + 1;
+	}
+	// Row 0 and missing textures get empty slots.
+	slots = new TextureAtlasSlot[(numTextures + 1) * numLevels];
+	memset(slots, 0, sizeof(TextureAtlasSlot) * (numTextures + 1) * numLevels);
+	int32_t numTexels = 0;
+	for (int32_t i = 0; i < numTextures; i++) {
+		if (!textures[i])
+			continue;
+		for (int32_t level = 0; level < numLevels; level++) {
+			Image *image = textures[i]->getMipmap(level);
+			TextureAtlasSlot &slot = slots[(i + 1) * numLevels + level];
+			slot.width = image->width;
+			slot.height = image->height;
+			if (level > textures[i]->numMipmaps) {
+				slot.offset = slots[(i + 1) * numLevels + level - 1].offset;
+				continue;
+			}
+			slot.offset = numTexels;
+			numTexels += (image->width * image->height + slotAlignment - 1) & ~(slotAlignment - 1);
+			hasIndices &= image->indices != nullptr;
+		}
+	}
+
+	int32_t numBytes = numTexels * int32_t(sizeof(uint32_t)) + (hasIndices ? numTexels : 0);
+	block = new uint8_t[numBytes + cacheLine];
+	pixels = (uint32_t *) (block + (cacheLine - uintptr_t(block) % cacheLine));
+	indices = hasIndices ? (uint8_t *) (pixels + numTexels) : nullptr;
+	for (int32_t i = 0; i < numTextures; i++) {
+		if (!textures[i])
+			continue;
+		for (int32_t level = 0; level <= textures[i]->numMipmaps; level++) {
+			Image *image = textures[i]->getMipmap(level);
+			const TextureAtlasSlot &slot = slots[(i + 1) * numLevels + level];
+			for (int32_t x = 0; x < image->width; x++) {
+				uint32_t *dst = pixels + slot.offset + x * image->height;
+				for (int32_t y = 0; y < image->height; y++)
+					dst[y] = convertColor(image->pixels[x + y * image->pitch], image->format, format);
+				if (!indices)
+					continue;
+				uint8_t *dstIndices = indices + slot.offset + x * image->height;
+				for (int32_t y = 0; y < image->height; y++)
+					dstIndices[y] = image->indices[x + y * image->width];
+			}
+		}
+	}
+}
+
+TextureAtlas::~TextureAtlas() {
+	delete[] slots;
+	delete[] block;
+}
 
 Image *Image::getRegion(int32_t x, int32_t y, int32_t w, int32_t h) {
 	Image *region = new Image(w, h);
@@ -91,15 +540,18 @@ Image *Image::getRegion(int32_t x, int32_t y, int32_t w, int32_t h) {
 		for (int dx = 0; dx < w; x++, dx++) {
 			if (x < 0 || x >= width || y < 0 || y >= height)
 				continue;
-			region->pixels[dx + dy * h] = pixels[x + y * width];
+			region->pixels[dx + dy * h] = pixels[x + y * pitch];
 		}
 	}
 	return region;
 }
 
 void Image::clear(uint32_t clearColor) {
-	for (int i = 0, n = width * height; i < n; i++) {
-		pixels[i] = clearColor;
+	clearColor = convertColor(clearColor, PIXEL_FORMAT_ARGB, format);
+	for (int32_t y = 0; y < height; y++) {
+		uint32_t *row = pixels + y * pitch;
+		for (int32_t x = 0; x < width; x++)
+			row[x] = clearColor;
 	}
 }
 
@@ -118,42 +570,84 @@ void Image::drawVerticalLine(int32_t x, int32_t ys, int32_t ye,
 		ys = 0;
 	if (ye >= height)
 		ye = height - 1;
-	int32_t frameWidth = width;
-	uint32_t *dst = pixels + x + ys * width;
+	color = convertColor(color, PIXEL_FORMAT_ARGB, format);
+	uint32_t *dst = pixels + x + ys * pitch;
 	for (int i = 0, n = ye - ys + 1; i < n; i++) {
 		*dst = color;
-		dst += frameWidth;
+		dst += pitch;
 	}
 }
 
-void Image::drawVerticalImageSlice(Image &texture, int32_t x, int32_t ys,
-								   int32_t ye, int32_t tx, uint8_t lightness) {
-	if (x < 0 || x >= width)
-		return;
-	if (tx < 0 || tx >= texture.width)
+template<typename Texels>
+static void drawSlice(Image &frame, const Texels &texels, int32_t textureHeight,
+					  int32_t x, int32_t ys, int32_t ye, bool useFixedPoint) {
+	if (x < 0 || x >= frame.width)
 		return;
 	if (ye < ys) {
 		int32_t tmp = ye;
 		ye = ys;
 		ys = tmp;
 	}
-	if (ye < 0 || ys >= height)
+	if (ye < 0 || ys >= frame.height)
+		return;
+	int32_t framePitch = frame.pitch;
+	if (useFixedPoint) {
+		// The clipped start is computed from the slice height instead of the
+		// rounded step, so the error doesn't grow with the clipped part. At most
+		// frame.height truncated steps follow, which keeps ty below textureHeight.
+		uint32_t height = uint32_t(ye - ys + 1);
+		uint32_t stepY = (uint32_t(textureHeight) << TEXEL_FP_BITS) / height;
+		uint32_t ty = ys < 0 ? uint32_t((uint64_t(-int64_t(ys)) * (uint64_t(textureHeight) << TEXEL_FP_BITS)) / height)
+							 : 0;
+		if (ys < 0)
+			ys = 0;
+		if (ye >= frame.height)
+			ye = frame.height - 1;
+		uint32_t *dst = frame.pixels + x + ys * framePitch;
+		for (int i = 0, n = ye - ys + 1; i < n; i++) {
+			*dst = texels.get(ty >> TEXEL_FP_BITS);
+			ty += stepY;
+			dst += framePitch;
+		}
 		return;
-	int32_t textureWidth = texture.width;
-	int32_t frameWidth = width;
-	float stepY = float(texture.height) / float(ye - ys + 1);
+	}
+	float stepY = float(textureHeight) / float(ye - ys + 1);
 	float ty = ys < 0 ? float(-ys) * stepY : 0;
 	if (ys < 0)
 		ys = 0;
-	if (ye >= height)
-		ye = height - 1;
-	uint32_t *src = texture.pixels + tx;
-	uint32_t *dst = pixels + x + ys * width;
+	if (ye >= frame.height)
+		ye = frame.height - 1;
+	uint32_t *dst = frame.pixels + x + ys * framePitch;
 	for (int i = 0, n = ye - ys + 1; i < n; i++) {
-		uint32_t color = src[(uint32_t(ty) * textureWidth)];
-		*dst = darken(color, lightness);
+		*dst = texels.get(uint32_t(ty));
 		ty += stepY;
-		dst += frameWidth;
+		dst += framePitch;
+	}
+}
+
+void Image::drawVerticalImageSlice(Image &texture, int32_t x, int32_t ys,
+								   int32_t ye, int32_t tx, uint8_t lightness, bool useFixedPoint) {
+	if (tx < 0 || tx >= texture.width)
+		return;
+	if (texture.columnPixels) {
+		ShadedTexels texels = {texture.columnPixels + tx * texture.height, 1, lightness, getAlphaMask(format)};
+		drawSlice(*this, texels, texture.height, x, ys, ye, useFixedPoint);
+	} else {
+		ShadedTexels texels = {texture.pixels + tx, texture.pitch, lightness, getAlphaMask(format)};
+		drawSlice(*this, texels, texture.height, x, ys, ye, useFixedPoint);
+	}
+}
+
+void Image::drawVerticalImageSlice(Image &texture, int32_t x, int32_t ys,
+								   int32_t ye, int32_t tx, const uint32_t *colorMap, bool useFixedPoint) {
+	if (tx < 0 || tx >= texture.width)
+		return;
+	if (texture.columnIndices) {
+		PaletteTexels texels = {texture.columnIndices + tx * texture.height, 1, colorMap};
+		drawSlice(*this, texels, texture.height, x, ys, ye, useFixedPoint);
+	} else {
+		PaletteTexels texels = {texture.indices + tx, texture.width, colorMap};
+		drawSlice(*this, texels, texture.height, x, ys, ye, useFixedPoint);
 	}
 }
 
@@ -176,8 +670,9 @@ void Image::drawRectangle(int32_t x, int32_t y, int32_t w, int32_t h,
 		dy2 = height - 1;
 
 	// Draw
-	uint32_t *dst = pixels + dx + dy * width;
-	uint32_t dstPitch = width - (dx2 - dx) - 1;
+	color = convertColor(color, PIXEL_FORMAT_ARGB, format);
+	uint32_t *dst = pixels + dx + dy * pitch;
+	uint32_t dstPitch = pitch - (dx2 - dx) - 1;
 	for (; dy <= dy2; dy++, dst += dstPitch) {
 		for (int32_t rx = dx; rx <= dx2; rx++, dst++) {
 			*dst = color;
@@ -185,20 +680,22 @@ void Image::drawRectangle(int32_t x, int32_t y, int32_t w, int32_t h,
 	}
 }
 
-void drawSprite(Image *frame, Image *sprite, float x, float y,
-				float scaledWidth, float scaledHeight, uint8_t lightness,
-				const float *zbuffer, float distance) {
-	// Calculate sub pixel accurate screen coordinates of screen aligned sprite
-	int32_t minX = floatToFixed(x, PIXEL_FP_BITS);
-	int32_t minY = floatToFixed(y, PIXEL_FP_BITS);
-	int32_t maxX = floatToFixed(x + scaledWidth, PIXEL_FP_BITS);
-	int32_t maxY = floatToFixed(y + scaledHeight, PIXEL_FP_BITS);
-	int32_t tx = 0, ty = 0;
+// First row k >= 0 of a sprite rectangle with ty + k * tyStep at or past the
+// texel row v, see drawSprite().
+static inline int32_t getFirstSpriteRow(int32_t v, int32_t ty, int32_t tyStep) {
+	int64_t start = (int64_t(v) << TEXEL_FP_BITS) - ty;
+	return start <= 0 ? 0 : int32_t((start + tyStep - 1) / tyStep);
+}
 
-	// Round top/left corner coordinate -> stabilizes sprite on screen
-	// Comment to see effect.
-	minX = fixedRound(minX, PIXEL_FP_BITS);
-	minY = fixedRound(minY, PIXEL_FP_BITS);
+// Draws the sprite into the screen rectangle [minX, maxX] x [minY, maxY], given
+// in PIXEL_FP_BITS fixed point, see VisibleSprite. Columns with a zbuffer entry
+// closer than distance are skipped. Depth is float or fixed point, matching the
+// zbuffer of the render path.
+template<typename Texels, typename Depth>
+static void drawSprite(Renderer &renderer, Image *sprite, const Texels &texels, int32_t minX, int32_t minY,
+					   int32_t maxX, int32_t maxY, const Depth *zbuffer, Depth distance) {
+	Image *frame = &renderer.frame;
+	int32_t tx = 0, ty = 0;
 
 	// Calculate texture x/y gradients based on rounded screen width and height
 	// of rectangle -> stabilizes texture point sampling.
@@ -206,8 +703,11 @@ void drawSprite(Image *frame, Image *sprite, float x, float y,
 			fixedToInt(fixedRound(maxX - minX + 1, PIXEL_FP_BITS), PIXEL_FP_BITS);
 	int32_t h =
 			fixedToInt(fixedRound(maxY - minY + 1, PIXEL_FP_BITS), PIXEL_FP_BITS);
-	int32_t txStep = floatToFixed(sprite->width / float(w), TEXEL_FP_BITS);
-	int32_t tyStep = floatToFixed(sprite->height / float(h), TEXEL_FP_BITS);
+	// Tiny or distant sprites round to an empty rectangle.
+	if (w <= 0 || h <= 0)
+		return;
+	int32_t txStep = (sprite->width << TEXEL_FP_BITS) / w;
+	int32_t tyStep = (sprite->height << TEXEL_FP_BITS) / h;
 
 	// Clip rectangle and texture coordinates
 	if (minX < 0) {
@@ -220,29 +720,103 @@ void drawSprite(Image *frame, Image *sprite, float x, float y,
 		ty = -fixedToInt(minY, PIXEL_FP_BITS) * tyStep;
 		minY = 0;
 	}
-	if (maxX >= floatToFixed(frame->width, PIXEL_FP_BITS))
-		maxX = floatToFixed(frame->width - 1, PIXEL_FP_BITS);
-	if (maxY >= floatToFixed(frame->height, PIXEL_FP_BITS))
-		maxY = floatToFixed(frame->height - 1, PIXEL_FP_BITS);
+	if (maxX >= (frame->width << PIXEL_FP_BITS))
+		maxX = (frame->width - 1) << PIXEL_FP_BITS;
+	if (maxY >= (frame->height << PIXEL_FP_BITS))
+		maxY = (frame->height - 1) << PIXEL_FP_BITS;
+
+	// Collect the runs of columns not hidden behind walls, runs[i * 2] to
+	// runs[i * 2 + 1] inclusive. Fully occluded sprites end here.
+	int32_t startX = fixedToInt(minX, PIXEL_FP_BITS), endX = fixedToInt(maxX, PIXEL_FP_BITS);
+	int32_t *runs = renderer.spriteRuns, numRuns = 0;
+	for (int32_t x = startX; x <= endX; x++) {
+		if (zbuffer[x] < distance)
+			continue;
+		runs[numRuns * 2] = x;
+		while (x < endX && zbuffer[x + 1] >= distance)
+			x++;
+		runs[numRuns * 2 + 1] = x;
+		numRuns++;
+	}
+	if (!numRuns)
+		return;
 
-	// Draw the clipped rectangle. Texel color of 0x00000000 -> transparent
-	int32_t px, py, ptx, pty;
+	// Draw the visible runs of the clipped rectangle. Texel color of
+	// 0x00000000 -> transparent
+	int32_t py, pty;
+	LILRAY_STATS(int64_t numPixels = 0);
+	if (sprite->posts && tyStep > 0) {
+		// Column by column, only the rows whose texel falls into a post. Row k
+		// of the rectangle samples texel row (ty + k * tyStep) >> TEXEL_FP_BITS.
+		int32_t startY = fixedToInt(minY, PIXEL_FP_BITS);
+		int32_t numRows = maxY >= minY ? fixedToInt(maxY - minY, PIXEL_FP_BITS) + 1 : 0;
+		for (int32_t i = 0; i < numRuns; i++) {
+			int32_t ptx = tx + (runs[i * 2] - startX) * txStep;
+			for (int32_t x = runs[i * 2], n = runs[i * 2 + 1]; x <= n; x++, ptx += txStep) {
+				int32_t u = fixedToInt(ptx, TEXEL_FP_BITS);
+				for (int32_t p = sprite->postStarts[u], pn = sprite->postStarts[u + 1]; p < pn; p++) {
+					int32_t first = getFirstSpriteRow(sprite->posts[p * 2], ty, tyStep);
+					int32_t end = getFirstSpriteRow(sprite->posts[p * 2 + 1], ty, tyStep);
+					if (end > numRows)
+						end = numRows;
+					pty = ty + first * tyStep;
+					uint32_t *dst = frame->pixels + (startY + first) * frame->pitch + x;
+					for (int32_t k = first; k < end; k++, pty += tyStep, dst += frame->pitch)
+						*dst = texels.get(fixedToInt(pty, TEXEL_FP_BITS) * sprite->width + u);
+					LILRAY_STATS(numPixels += end > first ? end - first : 0);
+				}
+			}
+		}
+		LILRAY_STATS(renderer.stats.spritePixels += numPixels; renderer.stats.spritesDrawn += numPixels > 0);
+		return;
+	}
 	for (py = minY, pty = ty; py <= maxY; py += PIXEL_FP_ONE, pty += tyStep) {
 		int32_t y = fixedToInt(py, PIXEL_FP_BITS);
 		int32_t v = fixedToInt(pty, TEXEL_FP_BITS);
-		uint32_t *dst = frame->pixels + y * frame->width;
-		uint32_t *src = sprite->pixels + v * sprite->width;
-		for (px = minX, ptx = tx; px <= maxX; px += PIXEL_FP_ONE, ptx += txStep) {
-			int32_t x = fixedToInt(px, PIXEL_FP_BITS);
-			if (zbuffer[x] < distance)
-				continue;
-			int32_t u = fixedToInt(ptx, TEXEL_FP_BITS);
-			uint32_t color = src[u];
-			if (!color)
-				continue;
-			dst[x] = darken(color, lightness);
+		uint32_t *dst = frame->pixels + y * frame->pitch;
+		int32_t row = v * sprite->width;
+		for (int32_t i = 0; i < numRuns; i++) {
+			int32_t ptx = tx + (runs[i * 2] - startX) * txStep;
+			for (int32_t x = runs[i * 2], n = runs[i * 2 + 1]; x <= n; x++, ptx += txStep) {
+				int32_t u = fixedToInt(ptx, TEXEL_FP_BITS);
+				if (texels.isTransparent(row + u))
+					continue;
+				dst[x] = texels.get(row + u);
+				LILRAY_STATS(numPixels++);
+			}
 		}
 	}
+	LILRAY_STATS(renderer.stats.spritePixels += numPixels; renderer.stats.spritesDrawn += numPixels > 0);
+}
+
+static void drawVisibleSprite(Renderer &renderer, VisibleSprite &visible, uint8_t lightness,
+							  const uint32_t *colorMap) {
+	Image *sprite = visible.sprite->image;
+	if (colorMap && sprite->indices) {
+		PaletteTexels texels = {sprite->indices, 1, colorMap};
+		if (renderer.useFixedPoint)
+			drawSprite(renderer, sprite, texels, visible.minX, visible.minY, visible.maxX, visible.maxY,
+					   (const int32_t *) renderer.zbufferFixedPoint, visible.depthFixedPoint);
+		else
+			drawSprite(renderer, sprite, texels, visible.minX, visible.minY, visible.maxX, visible.maxY,
+					   (const float *) renderer.zbuffer, visible.depth);
+	} else if (sprite->format != renderer.frame.format) {
+		ConvertedTexels texels = {sprite->pixels, 1, lightness, sprite->format, renderer.frame.format};
+		if (renderer.useFixedPoint)
+			drawSprite(renderer, sprite, texels, visible.minX, visible.minY, visible.maxX, visible.maxY,
+					   (const int32_t *) renderer.zbufferFixedPoint, visible.depthFixedPoint);
+		else
+			drawSprite(renderer, sprite, texels, visible.minX, visible.minY, visible.maxX, visible.maxY,
+					   (const float *) renderer.zbuffer, visible.depth);
+	} else {
+		ShadedTexels texels = {sprite->pixels, 1, lightness, getAlphaMask(renderer.frame.format)};
+		if (renderer.useFixedPoint)
+			drawSprite(renderer, sprite, texels, visible.minX, visible.minY, visible.maxX, visible.maxY,
+					   (const int32_t *) renderer.zbufferFixedPoint, visible.depthFixedPoint);
+		else
+			drawSprite(renderer, sprite, texels, visible.minX, visible.minY, visible.maxX, visible.maxY,
+					   (const float *) renderer.zbuffer, visible.depth);
+	}
 }
 
 void Image::drawText(Font &font, int32_t x, int32_t y, uint32_t color,
@@ -252,6 +826,7 @@ void Image::drawText(Font &font, int32_t x, int32_t y, uint32_t color,
 	va_start(args, fmt);
 	vsnprintf(text, 1024, fmt, args);
 	va_end(args);
+	color = convertColor(color, PIXEL_FORMAT_ARGB, format);
 
 	int32_t lineX = x;
 	int32_t lineY = y;
@@ -314,8 +889,8 @@ void Image::drawText(Font &font, int32_t x, int32_t y, uint32_t color,
 		// Draw
 		uint8_t *src = font.pixels + cx + cy * font.width;
 		uint32_t srcPitch = font.width - (dx2 - dx) - 1;
-		uint32_t *dst = pixels + dx + dy * width;
-		uint32_t dstPitch = width - (dx2 - dx) - 1;
+		uint32_t *dst = pixels + dx + dy * pitch;
+		uint32_t dstPitch = pitch - (dx2 - dx) - 1;
 		for (; dy <= dy2; dy++) {
 			for (int32_t rx = dx; rx <= dx2; rx++, dst++, src++) {
 				if (!*src)
@@ -331,16 +906,160 @@ void Image::drawText(Font &font, int32_t x, int32_t y, uint32_t color,
 }
 
 void Image::reverseColorChannels() {
-	int32_t numPixels = (width * height) << 2;
-	uint8_t *src = (uint8_t *) pixels;
-	uint8_t *dst = (uint8_t *) pixels;
-	for (size_t i = 0; i < numPixels; i += 4) {
-		uint8_t b = src[i], g = src[i + 1], r = src[i + 2], a = src[i + 3];
-		dst[i] = r;
-		dst[i + 1] = g;
-		dst[i + 2] = b;
-		dst[i + 3] = a;
+	for (int32_t y = 0; y < height; y++) {
+		uint8_t *src = (uint8_t *) (pixels + y * pitch);
+		uint8_t *dst = src;
+		for (int32_t i = 0, n = width << 2; i < n; i += 4) {
+			uint8_t b = src[i], g = src[i + 1], r = src[i + 2], a = src[i + 3];
+			dst[i] = r;
+			dst[i + 1] = g;
+			dst[i + 2] = b;
+			dst[i + 3] = a;
+		}
+	}
+}
+
+struct ColorBucket {
+	uint64_t r, g, b;
+	uint32_t count;
+};
+
+static inline int32_t getBucketComponent(uint16_t key, int32_t axis) {
+	return (key >> (10 - axis * 5)) & 0x1f;
+}
+
+static void buildColorMaps(Palette &palette) {
+	for (int32_t level = 0; level < palette.numLightLevels; level++) {
+		uint8_t lightness = palette.numLightLevels > 1 ? uint8_t(level * 255 / (palette.numLightLevels - 1)) : 255;
+		for (int32_t i = 0; i < 256; i++) {
+			uint32_t color = i < palette.numColors ? darken(palette.colors[i], lightness) : 0;
+			palette.colorMaps[(level << 8) + i] = convertColor(color, PIXEL_FORMAT_ARGB, palette.format);
+		}
+	}
+}
+
+Palette::Palette(Image **images, int32_t numImages, int32_t numLightLevels)
+	: numColors(1), numLightLevels(numLightLevels < 1 ? 1 : numLightLevels) {
+	// Histogram of all opaque texels in 15-bit color space, keeping the full
+	// precision sums to average the colors of each box.
+	const int32_t numBuckets = 1 << 15;
+	ColorBucket *buckets = new ColorBucket[numBuckets];
+	memset(buckets, 0, sizeof(ColorBucket) * numBuckets);
+	for (int32_t i = 0; i < numImages; i++) {
+		Image *image = images[i];
+		for (int32_t j = 0, n = image->width * image->height; j < n; j++) {
+			uint32_t color = convertColor(image->pixels[j], image->format, PIXEL_FORMAT_ARGB);
+			if (!color)
+				continue;
+			uint32_t key = ((color >> 9) & 0x7c00) | ((color >> 6) & 0x3e0) | ((color >> 3) & 0x1f);
+			ColorBucket &bucket = buckets[key];
+			bucket.r += (color >> 16) & 0xff;
+			bucket.g += (color >> 8) & 0xff;
+			bucket.b += color & 0xff;
+			bucket.count++;
+		}
+	}
+	uint16_t *keys = new uint16_t[numBuckets];
+	int32_t numKeys = 0;
+	for (int32_t i = 0; i < numBuckets; i++) {
+		if (buckets[i].count)
+			keys[numKeys++] = uint16_t(i);
 	}
+
+	// Median cut, always splitting the box with the most texels along its
+	// longest axis until all 255 colors are used.
+	struct Box {
+		int32_t start, end;
+		uint64_t count;
+	};
+	Box boxes[255];
+	int32_t numBoxes = 0;
+	if (numKeys) {
+		uint64_t count = 0;
+		for (int32_t i = 0; i < numKeys; i++) count += buckets[keys[i]].count;
+		boxes[numBoxes++] = {0, numKeys, count};
+	}
+	while (numBoxes < 255) {
+		int32_t split = -1;
+		for (int32_t i = 0; i < numBoxes; i++) {
+			if (boxes[i].end - boxes[i].start > 1 && (split < 0 || boxes[i].count > boxes[split].count))
+				split = i;
+		}
+		if (split < 0)
+			break;
+		Box &box = boxes[split];
+		int32_t axis = 0, maxRange = -1;
+		for (int32_t a = 0; a < 3; a++) {
+			int32_t minValue = 31, maxValue = 0;
+			for (int32_t i = box.start; i < box.end; i++) {
+				int32_t value = getBucketComponent(keys[i], a);
+				minValue = value < minValue ? value : minValue;
+				maxValue = value > maxValue ? value : maxValue;
+			}
+			if (maxValue - minValue > maxRange) {
+				maxRange = maxValue - minValue;
+				axis = a;
+			}
+		}
+		std::sort(keys + box.start, keys + box.end, [axis](uint16_t a, uint16_t b) {
+			return getBucketComponent(a, axis) < getBucketComponent(b, axis);
+		});
+		uint64_t half = box.count / 2, count = 0;
+		int32_t median = box.start + 1;
+		for (int32_t i = box.start; i < box.end - 1; i++) {
+			count += buckets[keys[i]].count;
+			median = i + 1;
+			if (count >= half)
+				break;
+		}
+		uint64_t lowerCount = 0;
+		for (int32_t i = box.start; i < median; i++) lowerCount += buckets[keys[i]].count;
+		boxes[numBoxes++] = {median, box.end, box.count - lowerCount};
+		box.end = median;
+		box.count = lowerCount;
+	}
+
+	memset(colors, 0, sizeof(colors));
+	for (int32_t i = 0; i < numBoxes; i++) {
+		uint64_t r = 0, g = 0, b = 0;
+		for (int32_t j = boxes[i].start; j < boxes[i].end; j++) {
+			ColorBucket &bucket = buckets[keys[j]];
+			r += bucket.r, g += bucket.g, b += bucket.b;
+		}
+		uint64_t count = boxes[i].count;
+		colors[numColors++] = 0xff000000 | uint32_t(r / count) << 16 | uint32_t(g / count) << 8 | uint32_t(b / count);
+	}
+	delete[] keys;
+	delete[] buckets;
+
+	colorMaps = new uint32_t[this->numLightLevels * 256];
+	format = PIXEL_FORMAT_ARGB;
+	buildColorMaps(*this);
+}
+
+Palette::~Palette() { delete[] colorMaps; }
+
+void Palette::setFormat(PixelFormat format) {
+	if (format == this->format)
+		return;
+	this->format = format;
+	buildColorMaps(*this);
+}
+
+uint8_t Palette::findColor(uint32_t color) {
+	int32_t r = (color >> 16) & 0xff, g = (color >> 8) & 0xff, b = color & 0xff;
+	int32_t nearest = 1, nearestDistance = INT32_MAX;
+	for (int32_t i = 1; i < numColors; i++) {
+		int32_t dr = r - int32_t((colors[i] >> 16) & 0xff);
+		int32_t dg = g - int32_t((colors[i] >> 8) & 0xff);
+		int32_t db = b - int32_t(colors[i] & 0xff);
+		int32_t distance = dr * dr + dg * dg + db * db;
+		if (distance < nearestDistance) {
+			nearest = i;
+			nearestDistance = distance;
+		}
+	}
+	return uint8_t(nearest);
 }
 
 Font::Font(const char *imageFile, int32_t charWidth, int32_t charHeight)
@@ -396,29 +1115,199 @@ void Font::getBounds(int32_t &width, int32_t &height, const char *fmt, ...) {
 	height = width > 0 ? maxHeight : 0;
 }
 
+// Cell index functions for each MapLayout.
+struct RowMajorLayout {
+	static int32_t getIndex(const Map &map, int32_t x, int32_t y) { return x + y * map.width; }
+};
+
+// Rows of 8x8 tiles, each tile stored row by row.
+struct TiledLayout {
+	static int32_t getIndex(const Map &map, int32_t x, int32_t y) {
+		return (((x >> 3) << 6) | (x & 7)) + (y >> 3) * (((map.width + 7) >> 3) << 6) + ((y & 7) << 3);
+	}
+};
+
+// Interleaves the bits of x and y, within a power of two square.
+struct MortonLayout {
+	static int32_t spreadBits(int32_t v) {
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		return (v | (v << 1)) & 0x55555555;
+	}
+
+	static int32_t getIndex(const Map &, int32_t x, int32_t y) { return spreadBits(x) | (spreadBits(y) << 1); }
+};
+
+static int32_t getNumStoredCells(int32_t width, int32_t height, MapLayout layout) {
+	if (layout == MAP_LAYOUT_TILED)
+		return ((width + 7) >> 3) * ((height + 7) >> 3) * 64;
+	if (layout == MAP_LAYOUT_MORTON) {
+		int32_t size = 1;
+		while (size < width || size < height) size <<= 1;
+		return size * size;
+	}
+	return width * height;
+}
+
 Map::Map(int32_t width, int32_t height, int32_t *cells)
-	: width(width), height(height) {
+	: width(width), height(height), cellType(MAP_CELL_INT32), layout(MAP_LAYOUT_ROW_MAJOR), ownsCells(true),
+	  distanceField(nullptr) {
 	this->cells = new int32_t[width * height];
 	memcpy(this->cells, cells, sizeof(int32_t) * width * height);
 }
 
-Map::~Map() { delete cells; }
+Map::Map(int32_t width, int32_t height, MapCellType cellType, const int32_t *cells, MapLayout layout)
+	: width(width), height(height), cellType(cellType), layout(layout), ownsCells(true),
+	  distanceField(nullptr) {
+	int32_t numStoredCells = getNumStoredCells(width, height, layout);
+	if (cellType == MAP_CELL_UINT16)
+		this->cells = new uint16_t[numStoredCells];
+	else if (cellType == MAP_CELL_UINT8)
+		this->cells = new uint8_t[numStoredCells];
+	else
+		this->cells = new int32_t[numStoredCells];
+	// Padding cells of the tiled and Morton layouts are never read, but keep
+	// them empty anyway.
+	memset(this->cells, 0, numStoredCells * (cellType == MAP_CELL_INT32 ? 4 : cellType == MAP_CELL_UINT16 ? 2 : 1));
+	for (int32_t y = 0; y < height; y++) {
+		for (int32_t x = 0; x < width; x++)
+			setCell(x, y, cells[x + y * width]);
+	}
+}
+
+Map::Map(int32_t width, int32_t height, int32_t *cells, bool ownsCells)
+	: width(width), height(height), cellType(MAP_CELL_INT32), layout(MAP_LAYOUT_ROW_MAJOR), cells(cells),
+	  ownsCells(ownsCells), distanceField(nullptr) {
+}
+
+Map::Map(int32_t width, int32_t height, uint16_t *cells, bool ownsCells)
+	: width(width), height(height), cellType(MAP_CELL_UINT16), layout(MAP_LAYOUT_ROW_MAJOR), cells(cells),
+	  ownsCells(ownsCells), distanceField(nullptr) {
+}
+
+Map::Map(int32_t width, int32_t height, uint8_t *cells, bool ownsCells)
+	: width(width), height(height), cellType(MAP_CELL_UINT8), layout(MAP_LAYOUT_ROW_MAJOR), cells(cells),
+	  ownsCells(ownsCells), distanceField(nullptr) {
+}
+
+Map::~Map() {
+	delete[] distanceField;
+	if (!ownsCells)
+		return;
+	if (cellType == MAP_CELL_UINT16)
+		delete[] (uint16_t *) cells;
+	else if (cellType == MAP_CELL_UINT8)
+		delete[] (uint8_t *) cells;
+	else
+		delete[] (int32_t *) cells;
+}
+
+static int32_t getCellIndex(const Map &map, int32_t x, int32_t y) {
+	if (map.layout == MAP_LAYOUT_TILED)
+		return TiledLayout::getIndex(map, x, y);
+	if (map.layout == MAP_LAYOUT_MORTON)
+		return MortonLayout::getIndex(map, x, y);
+	return RowMajorLayout::getIndex(map, x, y);
+}
+
+// Recomputes the distance field for the cells in [minX, maxX] x [minY, maxY].
+// Walls further than MAX_EMPTY_DISTANCE away don't matter, so a two pass
+// chamfer transform over the region grown by that much is exact.
+static void updateDistanceField(Map &map, int32_t minX, int32_t minY, int32_t maxX, int32_t maxY) {
+	const int32_t maxEmpty = Map::MAX_EMPTY_DISTANCE;
+	int32_t startX = minX - maxEmpty > 0 ? minX - maxEmpty : 0;
+	int32_t startY = minY - maxEmpty > 0 ? minY - maxEmpty : 0;
+	int32_t endX = maxX + maxEmpty < map.width ? maxX + maxEmpty : map.width - 1;
+	int32_t endY = maxY + maxEmpty < map.height ? maxY + maxEmpty : map.height - 1;
+	int32_t width = endX - startX + 1, height = endY - startY + 1;
+	uint8_t *distances = new uint8_t[width * height];
+	for (int32_t y = 0; y < height; y++) {
+		for (int32_t x = 0; x < width; x++) {
+			int32_t d = map.getCell(startX + x, startY + y) ? 0 : maxEmpty;
+			if (d && x > 0 && distances[x - 1 + y * width] + 1 < d) d = distances[x - 1 + y * width] + 1;
+			if (d && y > 0) {
+				const uint8_t *above = distances + (y - 1) * width;
+				if (x > 0 && above[x - 1] + 1 < d) d = above[x - 1] + 1;
+				if (above[x] + 1 < d) d = above[x] + 1;
+				if (x < width - 1 && above[x + 1] + 1 < d) d = above[x + 1] + 1;
+			}
+			distances[x + y * width] = uint8_t(d);
+		}
+	}
+	for (int32_t y = height - 1; y >= 0; y--) {
+		for (int32_t x = width - 1; x >= 0; x--) {
+			int32_t d = distances[x + y * width];
+			if (d && x < width - 1 && distances[x + 1 + y * width] + 1 < d) d = distances[x + 1 + y * width] + 1;
+			if (d && y < height - 1) {
+				const uint8_t *below = distances + (y + 1) * width;
+				if (x < width - 1 && below[x + 1] + 1 < d) d = below[x + 1] + 1;
+				if (below[x] + 1 < d) d = below[x] + 1;
+				if (x > 0 && below[x - 1] + 1 < d) d = below[x - 1] + 1;
+			}
+			distances[x + y * width] = uint8_t(d);
+		}
+	}
+	minX = minX > 0 ? minX : 0, minY = minY > 0 ? minY : 0;
+	maxX = maxX < map.width ? maxX : map.width - 1, maxY = maxY < map.height ? maxY : map.height - 1;
+	for (int32_t y = minY; y <= maxY; y++) {
+		for (int32_t x = minX; x <= maxX; x++)
+			map.distanceField[getCellIndex(map, x, y)] = distances[x - startX + (y - startY) * width];
+	}
+	delete[] distances;
+}
+
+void Map::createDistanceField() {
+	if (!distanceField) {
+		int32_t numStoredCells = getNumStoredCells(width, height, layout);
+		distanceField = new uint8_t[numStoredCells];
+		memset(distanceField, 0, numStoredCells);
+	}
+	updateDistanceField(*this, 0, 0, width - 1, height - 1);
+}
 
 void Map::setCell(int32_t x, int32_t y, int32_t value) {
 	if (x < 0 || x >= width || y < 0 || y >= height)
 		return;
-	cells[x + y * width] = value;
+	bool wasEmpty = getCell(x, y) == 0;
+	int32_t index = getCellIndex(*this, x, y);
+	if (cellType == MAP_CELL_UINT16)
+		((uint16_t *) cells)[index] = uint16_t(value);
+	else if (cellType == MAP_CELL_UINT8)
+		((uint8_t *) cells)[index] = uint8_t(value);
+	else
+		((int32_t *) cells)[index] = value;
+	// Only cells up to MAX_EMPTY_DISTANCE away can see a different nearest wall.
+	if (distanceField && wasEmpty != (getCell(x, y) == 0))
+		updateDistanceField(*this, x - MAX_EMPTY_DISTANCE, y - MAX_EMPTY_DISTANCE, x + MAX_EMPTY_DISTANCE,
+							y + MAX_EMPTY_DISTANCE);
+}
+
+template<typename Cell, typename Layout>
+static inline int32_t getMapCell(Map &map, int32_t x, int32_t y) {
+	if (x < 0 || x >= map.width || y < 0 || y >= map.height)
+		return 0;
+	return int32_t(((const Cell *) map.cells)[Layout::getIndex(map, x, y)]);
 }
 
 int32_t Map::getCell(int32_t x, int32_t y) {
 	if (x < 0 || x >= width || y < 0 || y >= height)
 		return 0;
-	return cells[x + y * width];
+	int32_t index = getCellIndex(*this, x, y);
+	if (cellType == MAP_CELL_UINT16)
+		return ((uint16_t *) cells)[index];
+	if (cellType == MAP_CELL_UINT8)
+		return ((uint8_t *) cells)[index];
+	return ((int32_t *) cells)[index];
 }
 
-int32_t Map::raycast(float rayX, float rayY, float rayDirX, float rayDirY,
-					 float maxDistance, float &hitX, float &hitY,
-					 float &distance) {
+// Instantiated per cell type and layout, so the DDA loop reads cells without
+// checking the map's cell type or layout on every step. With the distance field,
+// empty cells tell how far the ray can leap.
+template<typename Cell, typename Layout, bool useDistanceField>
+static inline int32_t raycastDDA(Map &map, float rayX, float rayY, float rayDirX, float rayDirY,
+								 float maxDistance, float &hitX, float &hitY, float &distance,
+								 int32_t *steps) {
 	// DDA implementation moving along grid intersections.
 	float rayStepX = sqrtf(1 + (rayDirY / rayDirX) * (rayDirY / rayDirX));
 	float rayStepY = sqrtf(1 + (rayDirX / rayDirY) * (rayDirX / rayDirY));
@@ -453,8 +1342,49 @@ int32_t Map::raycast(float rayX, float rayY, float rayDirX, float rayDirY,
 			distance = rayLengthY;
 			rayLengthY += rayStepY;
 		}
-		cell = getCell(mapX, mapY);
+		if (!useDistanceField) {
+			cell = getMapCell<Cell, Layout>(map, mapX, mapY);
+			continue;
+		}
+
+		// The map is convex, a ray that left it never comes back.
+		if (mapX < 0 || mapX >= map.width || mapY < 0 || mapY >= map.height) {
+			if ((mapX < 0 && mapStepX < 0) || (mapX >= map.width && mapStepX > 0) || (mapY < 0 && mapStepY < 0) ||
+				(mapY >= map.height && mapStepY > 0))
+				break;
+			continue;
+		}
+		int32_t index = Layout::getIndex(map, mapX, mapY);
+		int32_t empty = map.distanceField[index];
+		if (!empty) {
+			cell = int32_t(((const Cell *) map.cells)[index]);
+			continue;
+		}
+		if (empty == 1)
+			continue;
+
+		// Cells less than empty cells away along x and y are empty. Take every
+		// crossing before the one leaving that square at once. A crossing along an
+		// axis without steps has infinite or NaN length, so leave that axis alone.
+		float exitDistance = fminf(rayLengthX + float(empty - 1) * rayStepX, rayLengthY + float(empty - 1) * rayStepY);
+		if (!(exitDistance < maxDistance))
+			continue;
+		if (rayLengthX < exitDistance) {
+			int32_t crossings = int32_t(ceilf((exitDistance - rayLengthX) / rayStepX));
+			crossings = crossings < empty - 1 ? crossings : empty - 1;
+			mapX += crossings * mapStepX;
+			rayLengthX += float(crossings) * rayStepX;
+		}
+		if (rayLengthY < exitDistance) {
+			int32_t crossings = int32_t(ceilf((exitDistance - rayLengthY) / rayStepY));
+			crossings = crossings < empty - 1 ? crossings : empty - 1;
+			mapY += crossings * mapStepY;
+			rayLengthY += float(crossings) * rayStepY;
+		}
 	}
+	// Every step moves one cell along x or y.
+	if (steps)
+		*steps = abs(mapX - int(rayX)) + abs(mapY - int(rayY));
 	if (cell == 0)
 		return 0;
 
@@ -463,119 +1393,1121 @@ int32_t Map::raycast(float rayX, float rayY, float rayDirX, float rayDirY,
 	return cell;
 }
 
-Camera::Camera(float x, float y, float angle, float fieldOfView)
-	: x(x), y(y), angle(angle), fieldOfView(fieldOfView) {}
-
-void Camera::move(Map &map, float distance) {
-	float rayDirX = signum(distance) * cosf(angle * DEG_TO_RAD);
-	float rayDirY = signum(distance) * sinf(angle * DEG_TO_RAD);
-	int32_t cellX = int32_t(x + rayDirX * 0.1f),
-			cellY = int32_t(y + rayDirY * 0.1f);
-	if (map.getCell(cellX, int32_t(y)) <= 0)
-		x += rayDirX * fabs(fmin(0.1f, distance));
-	if (map.getCell(int32_t(x), cellY) <= 0)
-		y += rayDirY * fabs(fmin(0.1f, distance));
+template<typename Cell, typename Layout>
+static inline int32_t raycastDDAForLayout(Map &map, float rayX, float rayY, float rayDirX, float rayDirY,
+										  float maxDistance, float &hitX, float &hitY, float &distance,
+										  int32_t *steps) {
+	if (map.distanceField)
+		return raycastDDA<Cell, Layout, true>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance,
+											  steps);
+	return raycastDDA<Cell, Layout, false>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance,
+										   steps);
 }
 
-void Camera::strafe(Map &map, float distance) {
-	float rayDirX = signum(distance) * sinf(angle * DEG_TO_RAD);
-	float rayDirY = signum(distance) * -cosf(angle * DEG_TO_RAD);
-	int32_t cellX = int32_t(x + rayDirX * 0.1f),
-			cellY = int32_t(y + rayDirY * 0.1f);
-	if (map.getCell(cellX, int32_t(y)) <= 0)
-		x += rayDirX * fabs(fmin(0.1f, distance));
-	if (map.getCell(int32_t(x), cellY) <= 0)
-		y += rayDirY * fabs(fmin(0.1f, distance));
+template<typename Cell>
+static inline int32_t raycastDDAForCell(Map &map, float rayX, float rayY, float rayDirX, float rayDirY,
+										float maxDistance, float &hitX, float &hitY, float &distance,
+										int32_t *steps) {
+	if (map.layout == MAP_LAYOUT_TILED)
+		return raycastDDAForLayout<Cell, TiledLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													  distance, steps);
+	if (map.layout == MAP_LAYOUT_MORTON)
+		return raycastDDAForLayout<Cell, MortonLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													   distance, steps);
+	return raycastDDAForLayout<Cell, RowMajorLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													 distance, steps);
 }
 
-void Camera::rotate(float degrees) { angle += degrees; }
+static inline int32_t raycastDDA(Map &map, float rayX, float rayY, float rayDirX, float rayDirY,
+								 float maxDistance, float &hitX, float &hitY, float &distance,
+								 int32_t *steps) {
+	if (map.cellType == MAP_CELL_UINT16)
+		return raycastDDAForCell<uint16_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance, steps);
+	if (map.cellType == MAP_CELL_UINT8)
+		return raycastDDAForCell<uint8_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance, steps);
+	return raycastDDAForCell<int32_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance, steps);
+}
 
-Renderer::Renderer(int32_t width, int32_t height, Image *wallTextures[], int32_t numWallTextures, Image *floorTexture, Image *ceilingTexture)
-	: frame(width, height), zbuffer(new float[width]),
-	  wallTextures(wallTextures), numWallTextures(numWallTextures),
-	  floorTexture(floorTexture), ceilingTexture(ceilingTexture),
-	  useFixedPoint(false), drawWalls(true), drawFloorAndCeiling(true),
-	  drawSprites(true) {}
-
-void renderFloorAndCeilingFixedPoint(Renderer &renderer, Camera &camera,
-									 float lightDistance) {
-	Image &frame = renderer.frame;
-	float frameHalfHeight = float(frame.height) * 0.5f;
-	float camDirX = cosf(camera.angle * DEG_TO_RAD),
-		  camDirY = sinf(camera.angle * DEG_TO_RAD);
-	float camRightX = -camDirY, camRightY = camDirX;
-	float projectionPlaneWidth = tanf(camera.fieldOfView / 2 * DEG_TO_RAD);
-	float rayDirXLeft = camDirX + -projectionPlaneWidth * camRightX;
-	float rayDirYLeft = camDirY + -projectionPlaneWidth * camRightY;
-	float rayDirXRight = camDirX + projectionPlaneWidth * camRightX;
-	float rayDirYRight = camDirY + projectionPlaneWidth * camRightY;
-	float posZ = frameHalfHeight;
-	float scaleX = (rayDirXRight - rayDirXLeft) / float(renderer.frame.width);
-	float scaleY = (rayDirYRight - rayDirYLeft) / float(renderer.frame.width);
-	int32_t floorWidth = renderer.floorTexture->width;
-	int32_t floorHeight = renderer.floorTexture->height;
-	int32_t ceilingWidth = renderer.ceilingTexture->width;
-	int32_t ceilingHeight = renderer.ceilingTexture->height;
-	uint32_t *srcFloor = renderer.floorTexture->pixels;
-	uint32_t *srcCeiling = renderer.ceilingTexture->pixels;
-	uint32_t *dstFloor = frame.pixels + (frame.height - 1) * frame.width;
-	uint32_t *dstCeiling = frame.pixels;
-	int32_t frameWidth = frame.width;
-	float floorScaleX = scaleX * floorWidth;
-	float floorScaleY = scaleY * floorHeight;
-	float ceilingScaleX = scaleX * ceilingWidth;
-	float ceilingScaleY = scaleY * ceilingHeight;
+int32_t Map::raycast(float rayX, float rayY, float rayDirX, float rayDirY,
+					 float maxDistance, float &hitX, float &hitY,
+					 float &distance) {
+	return raycastDDA(*this, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance, nullptr);
+}
 
-	for (int32_t y = 0, n = frameHalfHeight; y < n; y++) {
-		int32_t p = int32_t(-(y - frameHalfHeight));
-		float rowDistance = posZ / p;
-		float cx = (camera.x + rowDistance * rayDirXLeft);
-		float cy = (camera.y + rowDistance * rayDirYLeft);
-		uint32_t floorStepX =
-				floatToFixed(rowDistance * floorScaleX, FLOOR_FP_BITS);
-		uint32_t floorStepY =
-				floatToFixed(rowDistance * floorScaleY, FLOOR_FP_BITS);
-		uint32_t floorX = floatToFixed(cx * floorWidth, FLOOR_FP_BITS);
-		uint32_t floorY = floatToFixed(cy * floorHeight, FLOOR_FP_BITS);
-		uint32_t ceilingStepX =
-				floatToFixed(rowDistance * ceilingScaleX, FLOOR_FP_BITS);
-		uint32_t ceilingStepY =
-				floatToFixed(rowDistance * ceilingScaleY, FLOOR_FP_BITS);
-		uint32_t ceilingX = floatToFixed(cx * ceilingWidth, FLOOR_FP_BITS);
-		uint32_t ceilingY = floatToFixed(cy * ceilingHeight, FLOOR_FP_BITS);
+// Longest step and distance of the fixed point DDA. Sums of two stay below
+// 1 << 31.
+#define MAX_FIXED_POINT_DISTANCE ((1 << 30) - 1)
+
+// raycastDDA() in WORLD_FP_BITS fixed point. Step lengths along rays that are
+// (almost) parallel to an axis are clamped to MAX_FIXED_POINT_DISTANCE.
+template<typename Cell, typename Layout>
+static inline int32_t raycastDDAFixedPoint(Map &map, int32_t rayX, int32_t rayY, int32_t rayDirX, int32_t rayDirY,
+										   int32_t maxDistance, int32_t &hitX, int32_t &hitY, int32_t &distance,
+										   int32_t *steps) {
+	const int64_t maxStep = MAX_FIXED_POINT_DISTANCE;
+	int64_t stepX = rayDirX ? (int64_t(1) << (2 * WORLD_FP_BITS)) / abs(rayDirX) : maxStep;
+	int64_t stepY = rayDirY ? (int64_t(1) << (2 * WORLD_FP_BITS)) / abs(rayDirY) : maxStep;
+	int32_t rayStepX = int32_t(stepX < maxStep ? stepX : maxStep);
+	int32_t rayStepY = int32_t(stepY < maxStep ? stepY : maxStep);
+	int32_t mapX = rayX >> WORLD_FP_BITS, mapY = rayY >> WORLD_FP_BITS, mapStepX, mapStepY;
+	int32_t rayLengthX, rayLengthY;
+	if (maxDistance > MAX_FIXED_POINT_DISTANCE)
+		maxDistance = MAX_FIXED_POINT_DISTANCE;
 
-		uint8_t lightness =
-				uint8_t((1 - fmin(rowDistance, lightDistance) / lightDistance) * 255);
-		for (int32_t x = 0, nn = frameWidth; x < nn;
-			 x++, dstFloor++, dstCeiling++) {
-			int32_t floorTx = fixedToInt(floorX, FLOOR_FP_BITS) & (floorWidth - 1);
-			int32_t floorTy = fixedToInt(floorY, FLOOR_FP_BITS) & (floorHeight - 1);
-			*dstFloor = darken(srcFloor[floorTx + floorWidth * floorTy], lightness);
+	if (rayDirX < 0) {
+		mapStepX = -1;
+		rayLengthX = fixedMultiply(rayX - (mapX << WORLD_FP_BITS), rayStepX, WORLD_FP_BITS);
+	} else {
+		mapStepX = 1;
+		rayLengthX = fixedMultiply(((mapX + 1) << WORLD_FP_BITS) - rayX, rayStepX, WORLD_FP_BITS);
+	}
+
+	if (rayDirY < 0) {
+		mapStepY = -1;
+		rayLengthY = fixedMultiply(rayY - (mapY << WORLD_FP_BITS), rayStepY, WORLD_FP_BITS);
+	} else {
+		mapStepY = 1;
+		rayLengthY = fixedMultiply(((mapY + 1) << WORLD_FP_BITS) - rayY, rayStepY, WORLD_FP_BITS);
+	}
+
+	int32_t cell = 0;
+	distance = 0;
+	while (!cell && distance < maxDistance) {
+		if (rayLengthX < rayLengthY) {
+			mapX += mapStepX;
+			distance = rayLengthX;
+			rayLengthX += rayStepX;
+		} else {
+			mapY += mapStepY;
+			distance = rayLengthY;
+			rayLengthY += rayStepY;
+		}
+		cell = getMapCell<Cell, Layout>(map, mapX, mapY);
+	}
+	if (steps)
+		*steps = abs(mapX - (rayX >> WORLD_FP_BITS)) + abs(mapY - (rayY >> WORLD_FP_BITS));
+	if (cell == 0)
+		return 0;
+
+	hitX = rayX + fixedMultiply(rayDirX, distance, WORLD_FP_BITS);
+	hitY = rayY + fixedMultiply(rayDirY, distance, WORLD_FP_BITS);
+	return cell;
+}
+
+template<typename Cell>
+static inline int32_t raycastDDAFixedPointForCell(Map &map, int32_t rayX, int32_t rayY, int32_t rayDirX,
+												  int32_t rayDirY, int32_t maxDistance, int32_t &hitX, int32_t &hitY,
+												  int32_t &distance, int32_t *steps) {
+	if (map.layout == MAP_LAYOUT_TILED)
+		return raycastDDAFixedPoint<Cell, TiledLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													   distance, steps);
+	if (map.layout == MAP_LAYOUT_MORTON)
+		return raycastDDAFixedPoint<Cell, MortonLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+														distance, steps);
+	return raycastDDAFixedPoint<Cell, RowMajorLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													  distance, steps);
+}
+
+static inline int32_t raycastDDAFixedPoint(Map &map, int32_t rayX, int32_t rayY, int32_t rayDirX, int32_t rayDirY,
+										   int32_t maxDistance, int32_t &hitX, int32_t &hitY, int32_t &distance,
+										   int32_t *steps) {
+	if (map.cellType == MAP_CELL_UINT16)
+		return raycastDDAFixedPointForCell<uint16_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													 distance, steps);
+	if (map.cellType == MAP_CELL_UINT8)
+		return raycastDDAFixedPointForCell<uint8_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+													distance, steps);
+	return raycastDDAFixedPointForCell<int32_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY,
+												distance, steps);
+}
+
+int32_t Map::raycastFixedPoint(int32_t rayX, int32_t rayY, int32_t rayDirX, int32_t rayDirY, int32_t maxDistance,
+							   int32_t &hitX, int32_t &hitY, int32_t &distance) {
+	return raycastDDAFixedPoint(*this, rayX, rayY, rayDirX, rayDirY, maxDistance, hitX, hitY, distance, nullptr);
+}
+
+#ifdef LILRAY_AVX2
+// Gathers the cells at index for the lanes in mask, other lanes keep cell.
+template<typename Cell>
+LILRAY_TARGET_AVX2 static inline __m256i gatherCells(__m256i cell, const void *cells, __m256i index, __m256i mask) {
+	// Narrow cells are gathered as the 4 bytes ending at the cell, or starting at
+	// cell 0, so the gather never reads outside the cells.
+	const int32_t cellSize = int32_t(sizeof(Cell));
+	__m256i byteIndex = _mm256_mullo_epi32(index, _mm256_set1_epi32(cellSize));
+	__m256i offset = _mm256_max_epi32(_mm256_sub_epi32(byteIndex, _mm256_set1_epi32(4 - cellSize)),
+									  _mm256_setzero_si256());
+	__m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *) cells, offset, mask, 1);
+	__m256i value = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_slli_epi32(_mm256_sub_epi32(byteIndex, offset), 3)),
+									 _mm256_set1_epi32((1 << (cellSize * 8)) - 1));
+	return _mm256_blendv_epi8(cell, value, mask);
+}
+
+template<>
+LILRAY_TARGET_AVX2 inline __m256i gatherCells<int32_t>(__m256i cell, const void *cells, __m256i index, __m256i mask) {
+	return _mm256_mask_i32gather_epi32(cell, (const int *) cells, index, mask, 4);
+}
+
+// Vector versions of the layouts' getIndex().
+template<typename Layout>
+LILRAY_TARGET_AVX2 static inline __m256i getCellIndices(const Map &map, __m256i x, __m256i y);
+
+template<>
+LILRAY_TARGET_AVX2 inline __m256i getCellIndices<RowMajorLayout>(const Map &map, __m256i x, __m256i y) {
+	return _mm256_add_epi32(x, _mm256_mullo_epi32(y, _mm256_set1_epi32(map.width)));
+}
+
+template<>
+LILRAY_TARGET_AVX2 inline __m256i getCellIndices<TiledLayout>(const Map &map, __m256i x, __m256i y) {
+	__m256i seven = _mm256_set1_epi32(7);
+	__m256i tileX = _mm256_or_si256(_mm256_slli_epi32(_mm256_srli_epi32(x, 3), 6), _mm256_and_si256(x, seven));
+	__m256i tileY = _mm256_mullo_epi32(_mm256_srli_epi32(y, 3), _mm256_set1_epi32(((map.width + 7) >> 3) << 6));
+	return _mm256_add_epi32(_mm256_add_epi32(tileX, tileY), _mm256_slli_epi32(_mm256_and_si256(y, seven), 3));
+}
+
+LILRAY_TARGET_AVX2 static inline __m256i spreadBits(__m256i v) {
+	v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 8)), _mm256_set1_epi32(0x00FF00FF));
+	v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 4)), _mm256_set1_epi32(0x0F0F0F0F));
+	v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 2)), _mm256_set1_epi32(0x33333333));
+	return _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 1)), _mm256_set1_epi32(0x55555555));
+}
+
+template<>
+LILRAY_TARGET_AVX2 inline __m256i getCellIndices<MortonLayout>(const Map &, __m256i x, __m256i y) {
+	return _mm256_or_si256(spreadBits(x), _mm256_slli_epi32(spreadBits(y), 1));
+}
+
+// Masked DDA over 8 lanes. Each step advances every active lane along x or y,
+// inactive lanes keep their state. Done once every lane hit a cell or went past
+// maxDistance. With the distance field, lanes leap like in raycastDDA().
+template<typename Cell, typename Layout, bool useDistanceField>
+LILRAY_TARGET_AVX2 static void raycastPacketAVX2(Map &map, const float *rayX, const float *rayY,
+												 const float *rayDirX, const float *rayDirY, const float *maxDistances,
+												 int32_t *cells, float *distances, int32_t *steps) {
+	// Same setup as Map::raycast(). sqrt and division are exact in both SSE and
+	// AVX, so every lane matches the scalar result bit for bit.
+	__m256 one = _mm256_set1_ps(1), zero = _mm256_setzero_ps();
+	__m256 dirX = _mm256_loadu_ps(rayDirX), dirY = _mm256_loadu_ps(rayDirY);
+	__m256 originX = _mm256_loadu_ps(rayX), originY = _mm256_loadu_ps(rayY);
+	__m256 slopeYX = _mm256_div_ps(dirY, dirX), slopeXY = _mm256_div_ps(dirX, dirY);
+	__m256 stepLengthX = _mm256_sqrt_ps(_mm256_add_ps(one, _mm256_mul_ps(slopeYX, slopeYX)));
+	__m256 stepLengthY = _mm256_sqrt_ps(_mm256_add_ps(one, _mm256_mul_ps(slopeXY, slopeXY)));
+	__m256i mapX = _mm256_cvttps_epi32(originX), mapY = _mm256_cvttps_epi32(originY);
+	__m256 cellX = _mm256_cvtepi32_ps(mapX), cellY = _mm256_cvtepi32_ps(mapY);
+	__m256 negativeX = _mm256_cmp_ps(dirX, zero, _CMP_LT_OQ), negativeY = _mm256_cmp_ps(dirY, zero, _CMP_LT_OQ);
+	__m256 lengthX = _mm256_mul_ps(_mm256_blendv_ps(_mm256_sub_ps(_mm256_add_ps(cellX, one), originX),
+													_mm256_sub_ps(originX, cellX), negativeX),
+								   stepLengthX);
+	__m256 lengthY = _mm256_mul_ps(_mm256_blendv_ps(_mm256_sub_ps(_mm256_add_ps(cellY, one), originY),
+													_mm256_sub_ps(originY, cellY), negativeY),
+								   stepLengthY);
+	__m256i stepX = _mm256_or_si256(_mm256_castps_si256(negativeX), _mm256_set1_epi32(1));
+	__m256i stepY = _mm256_or_si256(_mm256_castps_si256(negativeY), _mm256_set1_epi32(1));
+
+	__m256 distance = zero, maxLaneDistance = _mm256_loadu_ps(maxDistances);
+	__m256i cell = _mm256_setzero_si256(), noCell = _mm256_setzero_si256();
+	__m256i active = _mm256_castps_si256(_mm256_cmp_ps(zero, maxLaneDistance, _CMP_LT_OQ));
+	__m256i insideX = _mm256_set1_epi32(map.width - 1), insideY = _mm256_set1_epi32(map.height - 1);
+	while (!_mm256_testz_si256(active, active)) {
+		__m256i isStepX = _mm256_and_si256(active, _mm256_castps_si256(_mm256_cmp_ps(lengthX, lengthY, _CMP_LT_OQ)));
+		__m256i isStepY = _mm256_andnot_si256(isStepX, active);
+		__m256 maskX = _mm256_castsi256_ps(isStepX), maskY = _mm256_castsi256_ps(isStepY);
+		mapX = _mm256_add_epi32(mapX, _mm256_and_si256(stepX, isStepX));
+		mapY = _mm256_add_epi32(mapY, _mm256_and_si256(stepY, isStepY));
+		distance = _mm256_blendv_ps(_mm256_blendv_ps(distance, lengthY, maskY), lengthX, maskX);
+		lengthX = _mm256_add_ps(lengthX, _mm256_and_ps(maskX, stepLengthX));
+		lengthY = _mm256_add_ps(lengthY, _mm256_and_ps(maskY, stepLengthY));
+
+		// Unsigned min rejects coordinates outside [0, size), including negative
+		// ones. Lanes outside the map or inactive keep their cell.
+		__m256i inside = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_min_epu32(mapX, insideX), mapX),
+										  _mm256_cmpeq_epi32(_mm256_min_epu32(mapY, insideY), mapY));
+		__m256i index = getCellIndices<Layout>(map, mapX, mapY);
+		if (!useDistanceField) {
+			cell = gatherCells<Cell>(cell, map.cells, index, _mm256_and_si256(active, inside));
+			active = _mm256_and_si256(_mm256_and_si256(active, _mm256_cmpeq_epi32(cell, noCell)),
+									  _mm256_castps_si256(_mm256_cmp_ps(distance, maxLaneDistance, _CMP_LT_OQ)));
+			continue;
+		}
+
+		__m256i lanes = _mm256_and_si256(active, inside);
+		__m256i empty = gatherCells<uint8_t>(noCell, map.distanceField, index, lanes);
+		cell = gatherCells<Cell>(cell, map.cells, index, _mm256_and_si256(lanes, _mm256_cmpeq_epi32(empty, noCell)));
+		__m256i leftMap = _mm256_or_si256(
+				_mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi32(noCell, mapX), _mm256_castps_si256(negativeX)),
+								_mm256_andnot_si256(_mm256_castps_si256(negativeX), _mm256_cmpgt_epi32(mapX, insideX))),
+				_mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi32(noCell, mapY), _mm256_castps_si256(negativeY)),
+								_mm256_andnot_si256(_mm256_castps_si256(negativeY), _mm256_cmpgt_epi32(mapY, insideY))));
+		active = _mm256_andnot_si256(leftMap, _mm256_and_si256(
+				_mm256_and_si256(active, _mm256_cmpeq_epi32(cell, noCell)),
+				_mm256_castps_si256(_mm256_cmp_ps(distance, maxLaneDistance, _CMP_LT_OQ))));
+
+		// min_ps returns its second operand if either is NaN, a NaN exit then
+		// fails the compare and the lane doesn't leap.
+		__m256i leap = _mm256_and_si256(lanes, _mm256_cmpgt_epi32(empty, _mm256_set1_epi32(1)));
+		if (_mm256_testz_si256(leap, leap))
+			continue;
+		__m256i maxCrossings = _mm256_sub_epi32(empty, _mm256_set1_epi32(1));
+		__m256 leapLength = _mm256_cvtepi32_ps(maxCrossings);
+		__m256 exitDistance = _mm256_min_ps(_mm256_add_ps(lengthX, _mm256_mul_ps(leapLength, stepLengthX)),
+											_mm256_add_ps(lengthY, _mm256_mul_ps(leapLength, stepLengthY)));
+		leap = _mm256_and_si256(leap, _mm256_castps_si256(_mm256_cmp_ps(exitDistance, maxLaneDistance, _CMP_LT_OQ)));
+		__m256i leapX = _mm256_and_si256(leap, _mm256_castps_si256(_mm256_cmp_ps(lengthX, exitDistance, _CMP_LT_OQ)));
+		__m256i leapY = _mm256_and_si256(leap, _mm256_castps_si256(_mm256_cmp_ps(lengthY, exitDistance, _CMP_LT_OQ)));
+		__m256i crossingsX = _mm256_min_epi32(
+				_mm256_cvttps_epi32(_mm256_ceil_ps(_mm256_div_ps(_mm256_sub_ps(exitDistance, lengthX), stepLengthX))),
+				maxCrossings);
+		__m256i crossingsY = _mm256_min_epi32(
+				_mm256_cvttps_epi32(_mm256_ceil_ps(_mm256_div_ps(_mm256_sub_ps(exitDistance, lengthY), stepLengthY))),
+				maxCrossings);
+		crossingsX = _mm256_and_si256(crossingsX, leapX), crossingsY = _mm256_and_si256(crossingsY, leapY);
+		mapX = _mm256_add_epi32(mapX, _mm256_sign_epi32(crossingsX, stepX));
+		mapY = _mm256_add_epi32(mapY, _mm256_sign_epi32(crossingsY, stepY));
+		__m256 leapLengthX = _mm256_mul_ps(_mm256_cvtepi32_ps(crossingsX), stepLengthX);
+		__m256 leapLengthY = _mm256_mul_ps(_mm256_cvtepi32_ps(crossingsY), stepLengthY);
+		lengthX = _mm256_blendv_ps(lengthX, _mm256_add_ps(lengthX, leapLengthX), _mm256_castsi256_ps(leapX));
+		lengthY = _mm256_blendv_ps(lengthY, _mm256_add_ps(lengthY, leapLengthY), _mm256_castsi256_ps(leapY));
+	}
+	_mm256_storeu_si256((__m256i *) cells, cell);
+	_mm256_storeu_ps(distances, distance);
+	if (steps) {
+		__m256i originMapX = _mm256_cvttps_epi32(originX), originMapY = _mm256_cvttps_epi32(originY);
+		_mm256_storeu_si256((__m256i *) steps, _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(mapX, originMapX)),
+																_mm256_abs_epi32(_mm256_sub_epi32(mapY, originMapY))));
+	}
+}
+
+template<typename Cell, typename Layout>
+static void raycastPacketForLayout(Map &map, const float *rayX, const float *rayY, const float *rayDirX,
+								   const float *rayDirY, const float *maxDistances, int32_t *cells, float *distances,
+								   int32_t *steps) {
+	if (map.distanceField)
+		raycastPacketAVX2<Cell, Layout, true>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distances, steps);
+	else
+		raycastPacketAVX2<Cell, Layout, false>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distances,
+											   steps);
+}
+
+template<typename Cell>
+static void raycastPacketForCell(Map &map, const float *rayX, const float *rayY, const float *rayDirX,
+								 const float *rayDirY, const float *maxDistances, int32_t *cells, float *distances,
+								 int32_t *steps) {
+	if (map.layout == MAP_LAYOUT_TILED)
+		raycastPacketForLayout<Cell, TiledLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distances,
+												  steps);
+	else if (map.layout == MAP_LAYOUT_MORTON)
+		raycastPacketForLayout<Cell, MortonLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distances,
+												   steps);
+	else
+		raycastPacketForLayout<Cell, RowMajorLayout>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells,
+													 distances, steps);
+}
+
+static const bool useRaycastPacketAVX2 = cpuSupportsAVX2();
+#endif
+
+// Like Map::raycastPacket(), with a maximum distance per ray.
+static void raycastPacket(Map &map, int32_t numRays, const float *rayX, const float *rayY, const float *rayDirX,
+						  const float *rayDirY, const float *maxDistances, int32_t *cells, float *hitX, float *hitY,
+						  float *distance, int32_t *steps) {
+#ifdef LILRAY_AVX2
+	// Narrow cells and the distance field are gathered 4 bytes at a time, which
+	// needs at least 4 bytes.
+	if (useRaycastPacketAVX2 && numRays == Map::PACKET_SIZE &&
+		((map.cellType == MAP_CELL_INT32 && !map.distanceField) || map.width * map.height >= 4)) {
+		if (map.cellType == MAP_CELL_UINT16)
+			raycastPacketForCell<uint16_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distance, steps);
+		else if (map.cellType == MAP_CELL_UINT8)
+			raycastPacketForCell<uint8_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distance, steps);
+		else
+			raycastPacketForCell<int32_t>(map, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, distance, steps);
+		for (int32_t i = 0; i < numRays; i++) {
+			if (cells[i] == 0)
+				continue;
+			hitX[i] = rayX[i] + rayDirX[i] * distance[i];
+			hitY[i] = rayY[i] + rayDirY[i] * distance[i];
+		}
+		return;
+	}
+#endif
+	// Without gathers and blends, masked stepping is slower than the scalar
+	// DDA, see raycastPacketAVX2().
+	for (int32_t i = 0; i < numRays; i++)
+		cells[i] = raycastDDA(map, rayX[i], rayY[i], rayDirX[i], rayDirY[i], maxDistances[i], hitX[i], hitY[i],
+							  distance[i], steps ? steps + i : nullptr);
+}
+
+void Map::raycastPacket(int32_t numRays, const float *rayX, const float *rayY,
+						const float *rayDirX, const float *rayDirY, float maxDistance,
+						int32_t *cells, float *hitX, float *hitY, float *distance, int32_t *steps) {
+	float maxDistances[PACKET_SIZE];
+	for (int32_t i = 0; i < PACKET_SIZE; i++)
+		maxDistances[i] = maxDistance;
+	::raycastPacket(*this, numRays, rayX, rayY, rayDirX, rayDirY, maxDistances, cells, hitX, hitY, distance, steps);
+}
+
+struct RaycastBatch {
+	Map *map;
+	int32_t numRays;
+	const float *rayX, *rayY, *rayDirX, *rayDirY, *maxDistance;
+	int32_t *cells;
+	float *hitX, *hitY, *distance;
+};
+
+// Rays per thread pool task.
+static const int32_t RAYCAST_BATCH_SIZE = 1024;
+
+static void raycastBatchTask(void *data, int32_t index) {
+	RaycastBatch &batch = *(RaycastBatch *) data;
+	int32_t start = index * RAYCAST_BATCH_SIZE;
+	int32_t end = start + RAYCAST_BATCH_SIZE < batch.numRays ? start + RAYCAST_BATCH_SIZE : batch.numRays;
+	for (int32_t i = start; i < end; i += Map::PACKET_SIZE) {
+		int32_t numRays = end - i < Map::PACKET_SIZE ? end - i : Map::PACKET_SIZE;
+		raycastPacket(*batch.map, numRays, batch.rayX + i, batch.rayY + i, batch.rayDirX + i, batch.rayDirY + i,
+					  batch.maxDistance + i, batch.cells + i, batch.hitX + i, batch.hitY + i, batch.distance + i,
+					  nullptr);
+	}
+}
+
+void Map::raycastBatch(int32_t numRays, const float *rayX, const float *rayY, const float *rayDirX,
+					   const float *rayDirY, const float *maxDistance, int32_t *cells, float *hitX, float *hitY,
+					   float *distance, ThreadPool *threadPool) {
+	RaycastBatch batch = {this, numRays, rayX, rayY, rayDirX, rayDirY, maxDistance, cells, hitX, hitY, distance};
+	int32_t numTasks = (numRays + RAYCAST_BATCH_SIZE - 1) / RAYCAST_BATCH_SIZE;
+	if (threadPool)
+		threadPool->run(numTasks, raycastBatchTask, &batch);
+	else
+		for (int32_t i = 0; i < numTasks; i++)
+			raycastBatchTask(&batch, i);
+}
+
+SpriteGrid::SpriteGrid(int32_t width, int32_t height)
+	: width(width), height(height), numSprites(0), sprites(nullptr),
+	  cellStarts(new int32_t[width * height + 2]), maxSpriteWidth(0), maxSprites(0) {
+	memset(cellStarts, 0, sizeof(int32_t) * (width * height + 2));
+}
+
+SpriteGrid::~SpriteGrid() {
+	delete[] sprites;
+	delete[] cellStarts;
+}
+
+// Sprites outside the grid, or at NaN, go into the overflow bucket after the
+// last cell.
+static inline int32_t getSpriteCell(SpriteGrid &grid, Sprite *sprite) {
+	if (!(sprite->x >= 0 && sprite->x < float(grid.width) && sprite->y >= 0 && sprite->y < float(grid.height)))
+		return grid.width * grid.height;
+	return int32_t(sprite->x) + int32_t(sprite->y) * grid.width;
+}
+
+void SpriteGrid::update(Sprite **sprites, int32_t numSprites) {
+	if (numSprites > maxSprites) {
+		delete[] this->sprites;
+		this->sprites = new Sprite *[numSprites];
+		maxSprites = numSprites;
+	}
+	// Counting sort by cell. Counts go into the following cell's slot, so the
+	// prefix sum turns them into start offsets.
+	int32_t numCells = width * height + 1;
+	memset(cellStarts, 0, sizeof(int32_t) * (numCells + 1));
+	maxSpriteWidth = 0;
+	for (int32_t i = 0; i < numSprites; i++) {
+		Sprite *sprite = sprites[i];
+		cellStarts[getSpriteCell(*this, sprite) + 1]++;
+		float spriteWidth = sprite->height * float(sprite->image->width) / float(sprite->image->height);
+		maxSpriteWidth = spriteWidth > maxSpriteWidth ? spriteWidth : maxSpriteWidth;
+	}
+	for (int32_t i = 1; i <= numCells; i++)
+		cellStarts[i] += cellStarts[i - 1];
+	// Filling advances each start to the next cell's start, shift back after.
+	for (int32_t i = 0; i < numSprites; i++) {
+		int32_t cell = getSpriteCell(*this, sprites[i]);
+		this->sprites[cellStarts[cell]++] = sprites[i];
+	}
+	memmove(cellStarts + 1, cellStarts, sizeof(int32_t) * numCells);
+	cellStarts[0] = 0;
+	this->numSprites = cellStarts[numCells];
+}
+
+Camera::Camera(float x, float y, float angle, float fieldOfView)
+	: x(x), y(y), angle(angle), fieldOfView(fieldOfView) {}
 
-			int32_t ceilingTx =
-					fixedToInt(ceilingX, FLOOR_FP_BITS) & (ceilingWidth - 1);
-			int32_t ceilingTy =
-					fixedToInt(ceilingY, FLOOR_FP_BITS) & (ceilingHeight - 1);
-			*dstCeiling =
-					darken(srcCeiling[ceilingTx + ceilingWidth * ceilingTy], lightness);
+void Camera::move(Map &map, float distance) {
+	float rayDirX = signum(distance) * cosf(angle * DEG_TO_RAD);
+	float rayDirY = signum(distance) * sinf(angle * DEG_TO_RAD);
+	int32_t cellX = int32_t(x + rayDirX * 0.1f),
+			cellY = int32_t(y + rayDirY * 0.1f);
+	if (map.getCell(cellX, int32_t(y)) <= 0)
+		x += rayDirX * fabs(fmin(0.1f, distance));
+	if (map.getCell(int32_t(x), cellY) <= 0)
+		y += rayDirY * fabs(fmin(0.1f, distance));
+}
 
-			floorX += floorStepX;
-			floorY += floorStepY;
-			ceilingX += ceilingStepX;
-			ceilingY += ceilingStepY;
+void Camera::strafe(Map &map, float distance) {
+	float rayDirX = signum(distance) * sinf(angle * DEG_TO_RAD);
+	float rayDirY = signum(distance) * -cosf(angle * DEG_TO_RAD);
+	int32_t cellX = int32_t(x + rayDirX * 0.1f),
+			cellY = int32_t(y + rayDirY * 0.1f);
+	if (map.getCell(cellX, int32_t(y)) <= 0)
+		x += rayDirX * fabs(fmin(0.1f, distance));
+	if (map.getCell(int32_t(x), cellY) <= 0)
+		y += rayDirY * fabs(fmin(0.1f, distance));
+}
+
+void Camera::rotate(float degrees) { angle += degrees; }
+
+#ifndef LILRAY_NO_THREADS
+struct lilray::ThreadPoolState {
+	std::thread *workers;
+	int32_t numWorkers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	void (*task)(void *data, int32_t index);
+	void *data;
+	int32_t numTasks;
+	std::atomic<int32_t> nextTask;
+	int32_t activeWorkers;
+	uint32_t generation;
+	bool quit;
+};
+
+static void runTasks(ThreadPoolState *state) {
+	for (int32_t i = state->nextTask++; i < state->numTasks; i = state->nextTask++)
+		state->task(state->data, i);
+}
+
+static void workerLoop(ThreadPoolState *state) {
+	uint32_t generation = 0;
+	while (true) {
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->wake.wait(lock, [&] { return state->quit || state->generation != generation; });
+		if (state->quit)
+			return;
+		generation = state->generation;
+		lock.unlock();
+
+		runTasks(state);
+
+		lock.lock();
+		if (--state->activeWorkers == 0)
+			state->done.notify_one();
+	}
+}
+#endif
+
+ThreadPool::ThreadPool(int32_t numThreads) : state(nullptr) {
+#ifndef LILRAY_NO_THREADS
+	if (numThreads <= 0)
+		numThreads = int32_t(std::thread::hardware_concurrency());
+	if (numThreads < 1)
+		numThreads = 1;
+	this->numThreads = numThreads;
+	if (numThreads == 1)
+		return;
+	state = new ThreadPoolState();
+	state->numWorkers = numThreads - 1;
+	state->activeWorkers = 0;
+	state->generation = 0;
+	state->quit = false;
+	state->workers = new std::thread[state->numWorkers];
+	for (int32_t i = 0; i < state->numWorkers; i++)
+		state->workers[i] = std::thread(workerLoop, state);
+#else
+	this->numThreads = 1;
+#endif
+}
+
+ThreadPool::~ThreadPool() {
+#ifndef LILRAY_NO_THREADS
+	if (!state)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->quit = true;
+	}
+	state->wake.notify_all();
+	for (int32_t i = 0; i < state->numWorkers; i++)
+		state->workers[i].join();
+	delete[] state->workers;
+	delete state;
+#endif
+}
+
+void ThreadPool::run(int32_t numTasks, void (*task)(void *data, int32_t index), void *data) {
+#ifndef LILRAY_NO_THREADS
+	if (state && numTasks > 1) {
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->task = task;
+			state->data = data;
+			state->numTasks = numTasks;
+			state->nextTask = 0;
+			state->activeWorkers = state->numWorkers;
+			state->generation++;
 		}
-		dstFloor -= frameWidth << 1;
+		state->wake.notify_all();
+		runTasks(state);
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->done.wait(lock, [&] { return state->activeWorkers == 0; });
+		return;
+	}
+#endif
+	for (int32_t i = 0; i < numTasks; i++)
+		task(data, i);
+}
+
+Renderer::Renderer(int32_t width, int32_t height, Image *wallTextures[], int32_t numWallTextures, Image *floorTexture, Image *ceilingTexture)
+	: frame(width, height), zbuffer(new float[width]), zbufferFixedPoint(new int32_t[width]),
+	  spriteRuns(new int32_t[width + 1]), columnRayOffsets(nullptr), columnRaysWidth(0), columnRaysFieldOfView(0),
+	  projectionPlaneWidth(0), columnRayForwardFixedPoint(nullptr),
+	  columnRayRightFixedPoint(nullptr), projectionPlaneWidthFixedPoint(0),
+	  wallTextures(wallTextures), numWallTextures(numWallTextures), wallAtlas(nullptr),
+	  floorTexture(floorTexture), ceilingTexture(ceilingTexture), floorTextureCopy(nullptr),
+	  ceilingTextureCopy(nullptr), colorMaps(nullptr), colorMapsPalette(nullptr), textureCopiesHaveMipmaps(false),
+	  useFixedPoint(false), useSimd(true), useMipmaps(true), usePalette(false), palette(nullptr),
+	  drawWalls(true), drawFloorAndCeiling(true), drawSprites(true), stats(), threadPool(nullptr),
+	  visibleSprites(nullptr), numVisibleSprites(0), maxVisibleSprites(0), spriteOrder(nullptr),
+	  spriteOrderScratch(nullptr), sortedSprites(nullptr), numSortedSprites(0), maxSortedSprites(0),
+	  viewRenderers(nullptr), numViewRenderers(0) {
+	// wallAtlas and the texture copies are built on the first render, once the
+	// frame's format and useMipmaps are known.
+}
+
+Renderer::~Renderer() {
+	for (int32_t i = 0; i < numViewRenderers; i++) {
+		Renderer *view = viewRenderers[i];
+		view->wallAtlas = nullptr;
+		view->floorTextureCopy = nullptr;
+		view->ceilingTextureCopy = nullptr;
+		view->colorMaps = nullptr;
+		delete view;
+	}
+	delete[] viewRenderers;
+	delete threadPool;
+	delete wallAtlas;
+	delete floorTextureCopy;
+	delete ceilingTextureCopy;
+	delete[] colorMaps;
+	delete[] visibleSprites;
+	delete[] spriteOrder;
+	delete[] spriteOrderScratch;
+	delete[] sortedSprites;
+	delete[] spriteRuns;
+	delete[] zbuffer;
+	delete[] zbufferFixedPoint;
+	delete[] columnRayOffsets;
+	delete[] columnRayForwardFixedPoint;
+	delete[] columnRayRightFixedPoint;
+}
+
+void Renderer::setNumThreads(int32_t numThreads) {
+	delete threadPool;
+	threadPool = nullptr;
+	if (numThreads != 1)
+		threadPool = new ThreadPool(numThreads);
+}
+
+int32_t Renderer::getNumThreads() { return threadPool ? threadPool->numThreads : 1; }
+
+void Renderer::setRenderTarget(uint32_t *pixels, int32_t width, int32_t height, int32_t pitch, PixelFormat format) {
+	if (frame.ownsPixels)
+		delete[] frame.pixels;
+	frame.ownsPixels = !pixels;
+	frame.pixels = pixels ? pixels : new uint32_t[width * height];
+	frame.pitch = pixels ? pitch : width;
+	frame.format = format;
+	frame.height = height;
+	if (width != frame.width) {
+		frame.width = width;
+		delete[] zbuffer;
+		delete[] zbufferFixedPoint;
+		delete[] spriteRuns;
+		zbuffer = new float[width];
+		zbufferFixedPoint = new int32_t[width];
+		spriteRuns = new int32_t[width + 1];
+	}
+}
+
+static inline bool needsMipmaps(Renderer &renderer, Image *image) {
+	return renderer.useMipmaps && !image->numMipmaps && (image->width > 1 || image->height > 1);
+}
+
+// Copies the image and creates the copy's mipmaps, quantizing them too if the
+// image has palette indices.
+static Image *copyWithMipmaps(Renderer &renderer, Image *image, PixelFormat format) {
+	Image *copy = image->copy(format);
+	copy->createMipmaps();
+	if (copy->indices && renderer.palette) {
+		for (int32_t i = 0; i < copy->numMipmaps; i++)
+			copy->mipmaps[i]->quantize(*renderer.palette);
+	}
+	return copy;
+}
+
+// nullptr if the image can be read as is.
+static Image *copyForRenderer(Renderer &renderer, Image *image, PixelFormat format) {
+	if (!image)
+		return nullptr;
+	if (needsMipmaps(renderer, image))
+		return copyWithMipmaps(renderer, image, format);
+	return image->format != format ? image->copy(format) : nullptr;
+}
+
+static void updateTextureCopies(Renderer &renderer, PixelFormat format) {
+	// Wall textures without mipmaps get temporary copies with them, the atlas
+	// keeps all levels.
+	Image **textures = new Image *[renderer.numWallTextures];
+	for (int32_t i = 0; i < renderer.numWallTextures; i++) {
+		Image *texture = renderer.wallTextures[i];
+		textures[i] = texture && needsMipmaps(renderer, texture) ? copyWithMipmaps(renderer, texture, format) : texture;
+	}
+	delete renderer.wallAtlas;
+	renderer.wallAtlas = new TextureAtlas(textures, renderer.numWallTextures, format);
+	for (int32_t i = 0; i < renderer.numWallTextures; i++) {
+		if (textures[i] != renderer.wallTextures[i])
+			delete textures[i];
+	}
+	delete[] textures;
+	delete renderer.floorTextureCopy;
+	delete renderer.ceilingTextureCopy;
+	renderer.floorTextureCopy = copyForRenderer(renderer, renderer.floorTexture, format);
+	renderer.ceilingTextureCopy = copyForRenderer(renderer, renderer.ceilingTexture, format);
+	renderer.textureCopiesHaveMipmaps = renderer.useMipmaps;
+}
+
+static void updateColorMaps(Renderer &renderer, PixelFormat format) {
+	delete[] renderer.colorMaps;
+	renderer.colorMaps = nullptr;
+	renderer.colorMapsPalette = renderer.palette;
+	Palette *palette = renderer.palette;
+	if (!palette || palette->format == format)
+		return;
+	int32_t numEntries = palette->numLightLevels << 8;
+	renderer.colorMaps = new uint32_t[numEntries];
+	for (int32_t i = 0; i < numEntries; i++)
+		renderer.colorMaps[i] = convertColor(palette->colorMaps[i], palette->format, format);
+}
+
+static inline Image *getFloorTexture(Renderer &renderer) {
+	return renderer.floorTextureCopy ? renderer.floorTextureCopy : renderer.floorTexture;
+}
+
+static inline Image *getCeilingTexture(Renderer &renderer) {
+	return renderer.ceilingTextureCopy ? renderer.ceilingTextureCopy : renderer.ceilingTexture;
+}
+
+static inline const uint32_t *getColorMap(Renderer &renderer, uint8_t lightness) {
+	const uint32_t *colorMap = renderer.palette->getColorMap(lightness);
+	return renderer.colorMaps ? renderer.colorMaps + (colorMap - renderer.palette->colorMaps) : colorMap;
+}
+
+void Renderer::setPalette(Palette *palette) {
+	this->palette = palette;
+	if (!palette)
+		return;
+	for (int32_t i = 0; i < numWallTextures; i++) {
+		if (wallTextures[i])
+			wallTextures[i]->quantize(*palette);
+	}
+	if (floorTexture)
+		floorTexture->quantize(*palette);
+	if (ceilingTexture)
+		ceilingTexture->quantize(*palette);
+	// Before the first render, matchFormat() builds everything.
+	if (!wallAtlas)
+		return;
+	updateWallAtlas();
+	updateColorMaps(*this, wallAtlas->format);
+}
+
+void Renderer::updateWallAtlas() {
+	if (wallAtlas)
+		updateTextureCopies(*this, wallAtlas->format);
+}
+
+// Textures and the palette's color maps have to be in the frame's format to
+// be copied without swizzling. The renderer converts its own copies, the
+// caller's images are shared with other renderers and threads. Mipmaps are
+// only created once useMipmaps is set at render time.
+static void matchFormat(Renderer &renderer, PixelFormat format) {
+	bool formatChanged = !renderer.wallAtlas || renderer.wallAtlas->format != format;
+	if (formatChanged || (renderer.useMipmaps && !renderer.textureCopiesHaveMipmaps))
+		updateTextureCopies(renderer, format);
+	if (formatChanged || renderer.colorMapsPalette != renderer.palette)
+		updateColorMaps(renderer, format);
+}
+
+static void matchFrameFormat(Renderer &renderer) {
+	matchFormat(renderer, renderer.frame.format);
+}
+
+// Textures (and sprites) quantized against the palette are drawn through its
+// colormaps, everything else falls back to darken().
+static inline bool isPaletteActive(Renderer &renderer, Image *image) {
+	return renderer.usePalette && renderer.palette && image->indices;
+}
+
+static int32_t floorLog2(int32_t v) {
+	int32_t bits = 0;
+	while ((1 << (bits + 1)) <= v) bits++;
+	return bits;
+}
+
+// The mip level with about one texel per pixel, given how many texels of the
+// full size texture are skipped per pixel.
+static inline int32_t getMipmapLevel(Renderer &renderer, int32_t texelsPerPixel) {
+	return renderer.useMipmaps && texelsPerPixel > 1 ? floorLog2(texelsPerPixel) : 0;
+}
+
+// The atlas slot for a wall cell drawn from ys to ye.
+static inline const TextureAtlasSlot &getWallSlot(Renderer &renderer, int32_t cell, int32_t ys, int32_t ye) {
+	const TextureAtlas &atlas = *renderer.wallAtlas;
+	int32_t texelsPerPixel = int32_t(atlas.getSlot(cell, 0).height / (int64_t(ye) - ys + 1));
+	return atlas.getSlot(cell, getMipmapLevel(renderer, texelsPerPixel));
+}
+
+static inline void drawWallSlice(Renderer &renderer, const TextureAtlasSlot &slot, int32_t x, int32_t ys,
+								 int32_t ye, int32_t tx, uint8_t lightness) {
+	const TextureAtlas &atlas = *renderer.wallAtlas;
+	int32_t column = slot.offset + tx * slot.height;
+	if (renderer.usePalette && renderer.palette && atlas.indices) {
+		PaletteTexels texels = {atlas.indices + column, 1, getColorMap(renderer, lightness)};
+		drawSlice(renderer.frame, texels, slot.height, x, ys, ye, renderer.useFixedPoint);
+	} else {
+		ShadedTexels texels = {atlas.pixels + column, 1, lightness, getAlphaMask(renderer.frame.format)};
+		drawSlice(renderer.frame, texels, slot.height, x, ys, ye, renderer.useFixedPoint);
+	}
+}
+
+struct Bands {
+	void (*render)(void *data, int32_t start, int32_t end);
+	void *data;
+	int32_t size;
+	int32_t numBands;
+};
+
+// Splits [0, size) into bands and renders them on the thread pool. Using a few
+// more bands than threads evens out bands that are cheaper than others, e.g.
+// columns without walls.
+static void renderBands(Renderer &renderer, int32_t size,
+						void (*render)(void *data, int32_t start, int32_t end), void *data) {
+	int32_t numBands = renderer.getNumThreads() * 4;
+	if (numBands > size)
+		numBands = size;
+	if (renderer.getNumThreads() == 1 || numBands <= 1) {
+		render(data, 0, size);
+		return;
+	}
+	Bands bands = {render, data, size, numBands};
+	renderer.threadPool->run(
+			numBands, [](void *data, int32_t band) {
+				Bands &bands = *(Bands *) data;
+				int32_t start = int32_t(int64_t(bands.size) * band / bands.numBands);
+				int32_t end = int32_t(int64_t(bands.size) * (band + 1) / bands.numBands);
+				bands.render(bands.data, start, end);
+			},
+			&bands);
+}
+
+#ifdef LILRAY_ENABLE_STATS
+#ifndef LILRAY_NO_THREADS
+typedef std::atomic<int64_t> StatCounter;
+#else
+typedef int64_t StatCounter;
+#endif
+
+static double getMillisSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+#endif
+
+// Counters shared by the bands of a pass. Bands count locally and add their
+// totals once. Empty if stats are disabled.
+struct StatCounters {
+#ifdef LILRAY_ENABLE_STATS
+	StatCounter raysCast;
+	StatCounter ddaSteps;
+	StatCounter wallPixels;
+#endif
+};
+
+template<typename Texels>
+static void drawFloorSpanFixedPoint(uint32_t *dst, const Texels &texels, int32_t width, int32_t height,
+									uint32_t x, uint32_t y, uint32_t stepX, uint32_t stepY, int32_t count) {
+	for (int32_t i = 0; i < count; i++) {
+		int32_t tx = fixedToInt(x, FLOOR_FP_BITS) & (width - 1);
+		int32_t ty = fixedToInt(y, FLOOR_FP_BITS) & (height - 1);
+		dst[i] = texels.get(tx + width * ty);
+		x += stepX;
+		y += stepY;
+	}
+}
+
+// Draws a row of the floor or ceiling from the texture's mip level with about
+// one texel per pixel. cx/cy is the leftmost pixel's position in WORLD_FP_BITS,
+// stepX/stepY the step per pixel in twice as many bits.
+static void drawFloorRowFixedPoint(Renderer &renderer, Image *texture, uint32_t *dst, int64_t cx, int64_t cy,
+								   int64_t stepX, int64_t stepY, uint8_t lightness, bool usePalette) {
+	const int32_t toFloorBits = 2 * WORLD_FP_BITS - FLOOR_FP_BITS;
+	int64_t texelsX = (stepX < 0 ? -stepX : stepX) * texture->width;
+	int64_t texelsY = (stepY < 0 ? -stepY : stepY) * texture->height;
+	int32_t texelsPerPixel = int32_t((texelsX > texelsY ? texelsX : texelsY) >> (2 * WORLD_FP_BITS));
+	Image *mipmap = texture->getMipmap(getMipmapLevel(renderer, texelsPerPixel));
+	int32_t width = mipmap->width, height = mipmap->height;
+	uint32_t x = uint32_t((cx * width) >> (WORLD_FP_BITS - FLOOR_FP_BITS));
+	uint32_t y = uint32_t((cy * height) >> (WORLD_FP_BITS - FLOOR_FP_BITS));
+	uint32_t texelStepX = uint32_t((stepX * width) >> toFloorBits);
+	uint32_t texelStepY = uint32_t((stepY * height) >> toFloorBits);
+	if (usePalette && mipmap->indices) {
+		PaletteTexels texels = {mipmap->indices, 1, getColorMap(renderer, lightness)};
+		drawFloorSpanFixedPoint(dst, texels, width, height, x, y, texelStepX, texelStepY, renderer.frame.width);
+	} else {
+		ShadedTexels texels = {mipmap->pixels, 1, lightness, getAlphaMask(renderer.frame.format)};
+		drawFloorSpanFixedPoint(dst, texels, width, height, x, y, texelStepX, texelStepY, renderer.frame.width);
 	}
 }
 
+void renderFloorAndCeilingFixedPoint(Renderer &renderer, const FixedPointCamera &camera, int32_t startY,
+									 int32_t endY) {
+	Image &frame = renderer.frame;
+	int32_t projectionPlaneWidth = renderer.projectionPlaneWidthFixedPoint;
+	// Directions of the leftmost ray and the step between columns, times the
+	// frame width, in WORLD_FP_BITS.
+	int32_t rayDirXLeft = camera.dirX - fixedMultiply(projectionPlaneWidth, camera.rightX, WORLD_FP_BITS);
+	int32_t rayDirYLeft = camera.dirY - fixedMultiply(projectionPlaneWidth, camera.rightY, WORLD_FP_BITS);
+	int64_t scaleX = 2 * int64_t(fixedMultiply(projectionPlaneWidth, camera.rightX, WORLD_FP_BITS));
+	int64_t scaleY = 2 * int64_t(fixedMultiply(projectionPlaneWidth, camera.rightY, WORLD_FP_BITS));
+	int32_t frameWidth = frame.width, framePitch = frame.pitch;
+	Image *floorTexture = getFloorTexture(renderer), *ceilingTexture = getCeilingTexture(renderer);
+	bool usePalette = isPaletteActive(renderer, floorTexture) && isPaletteActive(renderer, ceilingTexture);
+
+	// Rows are independent of each other, so [startY, endY) can be rendered
+	// in any order and on any thread.
+	for (int32_t y = startY; y < endY; y++) {
+		int32_t p = (frame.height >> 1) - y;
+		if (p < 1)
+			p = 1;
+		uint32_t *dstFloor = frame.pixels + (frame.height - 1 - y) * framePitch;
+		uint32_t *dstCeiling = frame.pixels + y * framePitch;
+		// Half the frame height in WORLD_FP_BITS over p.
+		int32_t rowDistance = (frame.height << (WORLD_FP_BITS - 1)) / p;
+		int64_t cx = camera.x + fixedMultiply(rowDistance, rayDirXLeft, WORLD_FP_BITS);
+		int64_t cy = camera.y + fixedMultiply(rowDistance, rayDirYLeft, WORLD_FP_BITS);
+		int64_t stepX = rowDistance * scaleX / frameWidth, stepY = rowDistance * scaleY / frameWidth;
+		uint8_t lightness = uint8_t(255 - getDarknessFixedPoint(rowDistance, camera.lightDistance));
+		drawFloorRowFixedPoint(renderer, floorTexture, dstFloor, cx, cy, stepX, stepY, lightness, usePalette);
+		drawFloorRowFixedPoint(renderer, ceilingTexture, dstCeiling, cx, cy, stepX, stepY, lightness, usePalette);
+	}
+}
+
+// A horizontal floor or ceiling span. x/y are texel coordinates, advancing by
+// stepX/stepY per pixel. Texture sizes must be powers of two.
+struct FloorSpan {
+	uint32_t *dst;
+	const uint32_t *src;
+	int32_t width, height, widthShift;
+	float x, y, stepX, stepY;
+	uint32_t alphaMask;
+};
+
+typedef void (*FloorSpanKernel)(const FloorSpan &span, int32_t count, uint8_t lightness);
+
+template<typename Texels>
+static void drawFloorSpan(const FloorSpan &span, int32_t count, const Texels &texels) {
+	uint32_t *dst = span.dst;
+	int32_t widthMask = span.width - 1, heightMask = span.height - 1;
+	float x = span.x, y = span.y;
+	for (int32_t i = 0; i < count; i++) {
+		int32_t tx = int32_t(x) & widthMask;
+		int32_t ty = int32_t(y) & heightMask;
+		dst[i] = texels.get(tx + (ty << span.widthShift));
+		x += span.stepX;
+		y += span.stepY;
+	}
+}
+
+// Reference implementation, all SIMD kernels must match it.
+static void drawFloorSpan(const FloorSpan &span, int32_t count, uint8_t lightness) {
+	ShadedTexels texels = {span.src, 1, lightness, span.alphaMask};
+	drawFloorSpan(span, count, texels);
+}
+
+// The SIMD kernels accumulate the texel coordinates pixel by pixel, like
+// drawFloorSpan(), and only then load them into lanes, so they sample exactly
+// the same texels. Float additions don't reassociate, stepping lanes by
+// multiples of the step would round differently.
+static inline float stepFloorSpan(float &x, float step) {
+	float value = x;
+	x += step;
+	return value;
+}
+
+#ifdef LILRAY_SSE2
+static inline __m128i darken4(__m128i colors, __m128i lightness, __m128i alphaMask) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(colors, zero), lightness), 8);
+	__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(colors, zero), lightness), 8);
+	return _mm_or_si128(_mm_andnot_si128(alphaMask, _mm_packus_epi16(lo, hi)),
+						_mm_and_si128(alphaMask, colors));
+}
+
+static void drawFloorSpanSSE2(const FloorSpan &span, int32_t count, uint8_t lightness) {
+	float x = span.x, y = span.y;
+	__m128i widthMask = _mm_set1_epi32(span.width - 1), heightMask = _mm_set1_epi32(span.height - 1);
+	__m128i widthShift = _mm_cvtsi32_si128(span.widthShift);
+	__m128i light = _mm_set1_epi16(lightness);
+	__m128i alphaMask = _mm_set1_epi32(int32_t(span.alphaMask));
+	const uint32_t *src = span.src;
+	int32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		float x0 = stepFloorSpan(x, span.stepX), x1 = stepFloorSpan(x, span.stepX);
+		float x2 = stepFloorSpan(x, span.stepX), x3 = stepFloorSpan(x, span.stepX);
+		float y0 = stepFloorSpan(y, span.stepY), y1 = stepFloorSpan(y, span.stepY);
+		float y2 = stepFloorSpan(y, span.stepY), y3 = stepFloorSpan(y, span.stepY);
+		__m128i tx = _mm_and_si128(_mm_cvttps_epi32(_mm_setr_ps(x0, x1, x2, x3)), widthMask);
+		__m128i ty = _mm_and_si128(_mm_cvttps_epi32(_mm_setr_ps(y0, y1, y2, y3)), heightMask);
+		union {
+			__m128i v;
+			int32_t i[4];
+		} index;
+		index.v = _mm_add_epi32(tx, _mm_sll_epi32(ty, widthShift));
+		__m128i colors = _mm_set_epi32(int32_t(src[index.i[3]]), int32_t(src[index.i[2]]),
+									   int32_t(src[index.i[1]]), int32_t(src[index.i[0]]));
+		_mm_storeu_si128((__m128i *) (span.dst + i), darken4(colors, light, alphaMask));
+	}
+	FloorSpan tail = span;
+	tail.dst += i;
+	tail.x = x;
+	tail.y = y;
+	drawFloorSpan(tail, count - i, lightness);
+}
+#endif
+
+#ifdef LILRAY_AVX2
+LILRAY_TARGET_AVX2 static inline __m256i darken8(__m256i colors, __m256i lightness, __m256i alphaMask) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(colors, zero), lightness), 8);
+	__m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(colors, zero), lightness), 8);
+	return _mm256_or_si256(_mm256_andnot_si256(alphaMask, _mm256_packus_epi16(lo, hi)),
+						   _mm256_and_si256(alphaMask, colors));
+}
+
+LILRAY_TARGET_AVX2 static void drawFloorSpanAVX2(const FloorSpan &span, int32_t count, uint8_t lightness) {
+	float x = span.x, y = span.y;
+	__m256i widthMask = _mm256_set1_epi32(span.width - 1), heightMask = _mm256_set1_epi32(span.height - 1);
+	__m128i widthShift = _mm_cvtsi32_si128(span.widthShift);
+	__m256i light = _mm256_set1_epi16(lightness);
+	__m256i alphaMask = _mm256_set1_epi32(int32_t(span.alphaMask));
+	const int *src = (const int *) span.src;
+	int32_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		float x0 = stepFloorSpan(x, span.stepX), x1 = stepFloorSpan(x, span.stepX);
+		float x2 = stepFloorSpan(x, span.stepX), x3 = stepFloorSpan(x, span.stepX);
+		float x4 = stepFloorSpan(x, span.stepX), x5 = stepFloorSpan(x, span.stepX);
+		float x6 = stepFloorSpan(x, span.stepX), x7 = stepFloorSpan(x, span.stepX);
+		float y0 = stepFloorSpan(y, span.stepY), y1 = stepFloorSpan(y, span.stepY);
+		float y2 = stepFloorSpan(y, span.stepY), y3 = stepFloorSpan(y, span.stepY);
+		float y4 = stepFloorSpan(y, span.stepY), y5 = stepFloorSpan(y, span.stepY);
+		float y6 = stepFloorSpan(y, span.stepY), y7 = stepFloorSpan(y, span.stepY);
+		__m256i tx = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_setr_ps(x0, x1, x2, x3, x4, x5, x6, x7)), widthMask);
+		__m256i ty = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_setr_ps(y0, y1, y2, y3, y4, y5, y6, y7)), heightMask);
+		__m256i index = _mm256_add_epi32(tx, _mm256_sll_epi32(ty, widthShift));
+		__m256i colors = _mm256_i32gather_epi32(src, index, 4);
+		_mm256_storeu_si256((__m256i *) (span.dst + i), darken8(colors, light, alphaMask));
+	}
+	FloorSpan tail = span;
+	tail.dst += i;
+	tail.x = x;
+	tail.y = y;
+	drawFloorSpan(tail, count - i, lightness);
+}
+#endif
+
+#ifdef LILRAY_NEON
+static inline uint32x4_t darken4(uint32x4_t colors, uint8x8_t lightness, uint32x4_t alphaMask) {
+	uint8x16_t bytes = vreinterpretq_u8_u32(colors);
+	uint8x8_t lo = vshrn_n_u16(vmull_u8(vget_low_u8(bytes), lightness), 8);
+	uint8x8_t hi = vshrn_n_u16(vmull_u8(vget_high_u8(bytes), lightness), 8);
+	uint32x4_t darkened = vreinterpretq_u32_u8(vcombine_u8(lo, hi));
+	return vbslq_u32(alphaMask, colors, darkened);
+}
+
+static void drawFloorSpanNEON(const FloorSpan &span, int32_t count, uint8_t lightness) {
+	float x = span.x, y = span.y;
+	int32x4_t widthMask = vdupq_n_s32(span.width - 1), heightMask = vdupq_n_s32(span.height - 1);
+	int32x4_t widthShift = vdupq_n_s32(span.widthShift);
+	uint8x8_t light = vdup_n_u8(lightness);
+	uint32x4_t alphaMask = vdupq_n_u32(span.alphaMask);
+	const uint32_t *src = span.src;
+	int32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		float x0 = stepFloorSpan(x, span.stepX), x1 = stepFloorSpan(x, span.stepX);
+		float x2 = stepFloorSpan(x, span.stepX), x3 = stepFloorSpan(x, span.stepX);
+		float y0 = stepFloorSpan(y, span.stepY), y1 = stepFloorSpan(y, span.stepY);
+		float y2 = stepFloorSpan(y, span.stepY), y3 = stepFloorSpan(y, span.stepY);
+		float32x4_t vx = vsetq_lane_f32(x3, vsetq_lane_f32(x2, vsetq_lane_f32(x1, vdupq_n_f32(x0), 1), 2), 3);
+		float32x4_t vy = vsetq_lane_f32(y3, vsetq_lane_f32(y2, vsetq_lane_f32(y1, vdupq_n_f32(y0), 1), 2), 3);
+		int32x4_t tx = vandq_s32(vcvtq_s32_f32(vx), widthMask);
+		int32x4_t ty = vandq_s32(vcvtq_s32_f32(vy), heightMask);
+		int32x4_t index = vaddq_s32(tx, vshlq_s32(ty, widthShift));
+		uint32x4_t colors = vdupq_n_u32(src[vgetq_lane_s32(index, 0)]);
+		colors = vsetq_lane_u32(src[vgetq_lane_s32(index, 1)], colors, 1);
+		colors = vsetq_lane_u32(src[vgetq_lane_s32(index, 2)], colors, 2);
+		colors = vsetq_lane_u32(src[vgetq_lane_s32(index, 3)], colors, 3);
+		vst1q_u32(span.dst + i, darken4(colors, light, alphaMask));
+	}
+	FloorSpan tail = span;
+	tail.dst += i;
+	tail.x = x;
+	tail.y = y;
+	drawFloorSpan(tail, count - i, lightness);
+}
+#endif
+
+static FloorSpanKernel selectFloorSpanKernel() {
+#ifdef LILRAY_AVX2
+	if (cpuSupportsAVX2())
+		return drawFloorSpanAVX2;
+#endif
+#if defined(LILRAY_SSE2)
+	return drawFloorSpanSSE2;
+#elif defined(LILRAY_NEON)
+	return drawFloorSpanNEON;
+#else
+	return drawFloorSpan;
+#endif
+}
+
+static const FloorSpanKernel drawFloorSpanSIMD = selectFloorSpanKernel();
+
+// Switches the span to the texture's mip level with about one texel per pixel.
+// Texture sizes are powers of two, so rescaling the coordinates is exact.
+static Image *selectFloorMipmap(Renderer &renderer, Image *texture, FloorSpan &span) {
+	float stepX = fabsf(span.stepX), stepY = fabsf(span.stepY);
+	Image *mipmap = texture->getMipmap(getMipmapLevel(renderer, int32_t(stepX > stepY ? stepX : stepY)));
+	if (mipmap == texture)
+		return texture;
+	float scaleX = float(mipmap->width) / float(texture->width);
+	float scaleY = float(mipmap->height) / float(texture->height);
+	span.src = mipmap->pixels;
+	span.width = mipmap->width;
+	span.height = mipmap->height;
+	span.widthShift = floorLog2(mipmap->width);
+	span.x *= scaleX;
+	span.y *= scaleY;
+	span.stepX *= scaleX;
+	span.stepY *= scaleY;
+	return mipmap;
+}
+
 void renderFloorAndCeiling(Renderer &renderer, Camera &camera,
-						   float lightDistance) {
+						   float lightDistance, int32_t startY, int32_t endY) {
 	Image &frame = renderer.frame;
 	float frameHalfHeight = float(frame.height) * 0.5f;
 	float camDirX = cosf(camera.angle * DEG_TO_RAD),
 		  camDirY = sinf(camera.angle * DEG_TO_RAD);
 	float camRightX = -camDirY, camRightY = camDirX;
-	float projectionPlaneWidth = tanf(camera.fieldOfView / 2 * DEG_TO_RAD);
+	float projectionPlaneWidth = renderer.projectionPlaneWidth;
 	float rayDirXLeft = camDirX + -projectionPlaneWidth * camRightX;
 	float rayDirYLeft = camDirY + -projectionPlaneWidth * camRightY;
 	float rayDirXRight = camDirX + projectionPlaneWidth * camRightX;
@@ -583,22 +2515,27 @@ void renderFloorAndCeiling(Renderer &renderer, Camera &camera,
 	float posZ = frameHalfHeight;
 	float scaleX = (rayDirXRight - rayDirXLeft) / float(renderer.frame.width);
 	float scaleY = (rayDirYRight - rayDirYLeft) / float(renderer.frame.width);
-	int32_t floorWidth = renderer.floorTexture->width;
-	int32_t floorHeight = renderer.floorTexture->height;
-	int32_t ceilingWidth = renderer.ceilingTexture->width;
-	int32_t ceilingHeight = renderer.ceilingTexture->height;
-	uint32_t *srcFloor = renderer.floorTexture->pixels;
-	uint32_t *srcCeiling = renderer.ceilingTexture->pixels;
-	uint32_t *dstFloor = frame.pixels + (frame.height - 1) * frame.width;
-	uint32_t *dstCeiling = frame.pixels;
-	int32_t frameWidth = frame.width;
+	Image *floorTexture = getFloorTexture(renderer), *ceilingTexture = getCeilingTexture(renderer);
+	int32_t floorWidth = floorTexture->width;
+	int32_t floorHeight = floorTexture->height;
+	int32_t ceilingWidth = ceilingTexture->width;
+	int32_t ceilingHeight = ceilingTexture->height;
+	uint32_t *srcFloor = floorTexture->pixels;
+	uint32_t *srcCeiling = ceilingTexture->pixels;
+	int32_t frameWidth = frame.width, framePitch = frame.pitch;
+	uint32_t alphaMask = getAlphaMask(frame.format);
 	float floorScaleX = scaleX * floorWidth;
 	float floorScaleY = scaleY * floorHeight;
 	float ceilingScaleX = scaleX * ceilingWidth;
 	float ceilingScaleY = scaleY * ceilingHeight;
+	int32_t floorShift = floorLog2(floorWidth), ceilingShift = floorLog2(ceilingWidth);
+	FloorSpanKernel drawSpan = renderer.useSimd ? drawFloorSpanSIMD : FloorSpanKernel(drawFloorSpan);
+	bool usePalette = isPaletteActive(renderer, floorTexture) && isPaletteActive(renderer, ceilingTexture);
 
-	for (int32_t y = 0, n = frameHalfHeight; y < n; y++) {
+	for (int32_t y = startY; y < endY; y++) {
 		int32_t p = int32_t(-(y - frameHalfHeight));
+		uint32_t *dstFloor = frame.pixels + (frame.height - 1 - y) * framePitch;
+		uint32_t *dstCeiling = frame.pixels + y * framePitch;
 		float rowDistance = posZ / p;
 		float cx = (camera.x + rowDistance * rayDirXLeft);
 		float cy = (camera.y + rowDistance * rayDirYLeft);
@@ -613,102 +2550,860 @@ void renderFloorAndCeiling(Renderer &renderer, Camera &camera,
 
 		uint8_t lightness =
 				uint8_t((1 - fmin(rowDistance, lightDistance) / lightDistance) * 255);
-		for (int32_t x = 0, nn = frameWidth; x < nn;
-			 x++, dstFloor++, dstCeiling++) {
-			int32_t floorTx = int32_t(floorX) & (floorWidth - 1);
-			int32_t floorTy = int32_t(floorY) & (floorHeight - 1);
-			*dstFloor = darken(srcFloor[floorTx + floorWidth * floorTy], lightness);
-
-			int32_t ceilingTx = int32_t(ceilingX) & (ceilingWidth - 1);
-			int32_t ceilingTy = int32_t(ceilingY) & (ceilingHeight - 1);
-			*dstCeiling =
-					darken(srcCeiling[ceilingTx + ceilingWidth * ceilingTy], lightness);
-
-			floorX += floorStepX;
-			floorY += floorStepY;
-			ceilingX += ceilingStepX;
-			ceilingY += ceilingStepY;
+		FloorSpan floorSpan = {dstFloor, srcFloor, floorWidth, floorHeight, floorShift,
+							   floorX, floorY, floorStepX, floorStepY, alphaMask};
+		FloorSpan ceilingSpan = {dstCeiling, srcCeiling, ceilingWidth, ceilingHeight, ceilingShift,
+								 ceilingX, ceilingY, ceilingStepX, ceilingStepY, alphaMask};
+		Image *floorMipmap = selectFloorMipmap(renderer, floorTexture, floorSpan);
+		Image *ceilingMipmap = selectFloorMipmap(renderer, ceilingTexture, ceilingSpan);
+		if (usePalette && floorMipmap->indices && ceilingMipmap->indices) {
+			// Colormap lookups are a plain gather, no need for the SIMD kernels.
+			const uint32_t *colorMap = getColorMap(renderer, lightness);
+			PaletteTexels floorTexels = {floorMipmap->indices, 1, colorMap};
+			PaletteTexels ceilingTexels = {ceilingMipmap->indices, 1, colorMap};
+			drawFloorSpan(floorSpan, frameWidth, floorTexels);
+			drawFloorSpan(ceilingSpan, frameWidth, ceilingTexels);
+		} else {
+			drawSpan(floorSpan, frameWidth, lightness);
+			drawSpan(ceilingSpan, frameWidth, lightness);
 		}
-		dstFloor -= frameWidth << 1;
 	}
 }
 
-void Renderer::render(Camera &camera, Map &map, Sprite **sprites,
-					  int32_t numSprites, float lightDistance) {
-	float frameHalfWidth = float(frame.width) / 2.0f;
+void renderWalls(Renderer &renderer, Camera &camera, Map &map,
+				 float lightDistance, int32_t startX, int32_t endX, StatCounters &counters) {
+	// Only used if stats are enabled.
+	(void) counters;
+	Image &frame = renderer.frame;
 	float frameHalfHeight = float(frame.height) / 2.0f;
 	float maxDistance =
 			sqrtf(float(map.width * map.width) + float(map.height * map.height));
 	float camDirX = cosf(camera.angle * DEG_TO_RAD),
 		  camDirY = sinf(camera.angle * DEG_TO_RAD);
 	float camRightX = -camDirY, camRightY = camDirX;
-	float projectionPlaneWidth = tanf(camera.fieldOfView / 2 * DEG_TO_RAD);
-
-	for (int i = 0; i < frame.width; i++)
-		zbuffer[i] = INFINITY;
+	const float *rayOffsets = renderer.columnRayOffsets;
+
+	// Cast rays for packets of neighbouring columns, then draw the columns.
+	const int32_t N = Map::PACKET_SIZE;
+	float rayX[N], rayY[N], rayDirX[N], rayDirY[N];
+	float hitX[N], hitY[N], distances[N];
+	int32_t cells[N];
+	LILRAY_STATS(int32_t steps[N]; int64_t raysCast = 0, ddaSteps = 0, wallPixels = 0);
+	for (int32_t packetX = startX; packetX < endX; packetX += N) {
+		int32_t numRays = endX - packetX < N ? endX - packetX : N;
+		for (int32_t i = 0; i < numRays; i++) {
+			int32_t x = packetX + i;
+			rayX[i] = camera.x, rayY[i] = camera.y;
+			rayDirX[i] = camDirX + rayOffsets[x] * camRightX,
+			rayDirY[i] = camDirY + rayOffsets[x] * camRightY;
+			float rayDirLen = sqrtf(rayDirX[i] * rayDirX[i] + rayDirY[i] * rayDirY[i]);
+			rayDirX[i] /= rayDirLen, rayDirY[i] /= rayDirLen;
+		}
+		map.raycastPacket(numRays, rayX, rayY, rayDirX, rayDirY, maxDistance,
+						  cells, hitX, hitY, distances LILRAY_STATS(, steps));
+		LILRAY_STATS(raysCast += numRays; for (int32_t i = 0; i < numRays; i++) ddaSteps += steps[i]);
 
-	if (drawFloorAndCeiling && floorTexture && ceilingTexture) {
-		if (!useFixedPoint)
-			renderFloorAndCeiling(*this, camera, lightDistance);
-		else
-			renderFloorAndCeilingFixedPoint(*this, camera, lightDistance);
-	}
-
-	if (drawWalls) {
-		for (int32_t x = 0; x < frame.width; x++) {
-			float rayX = camera.x, rayY = camera.y;
-			float offset = ((float(x) * 2.0f / (float(frame.width) - 1.0f)) - 1.0f) *
-						   projectionPlaneWidth;
-			float rayDirX = camDirX + offset * camRightX,
-				  rayDirY = camDirY + offset * camRightY;
-			float rayDirLen = sqrtf(rayDirX * rayDirX + rayDirY * rayDirY);
-			rayDirX /= rayDirLen, rayDirY /= rayDirLen;
-
-			float distance, hitX, hitY;
-			int32_t cell = map.raycast(rayX, rayY, rayDirX, rayDirY, maxDistance,
-									   hitX, hitY, distance);
+		for (int32_t i = 0; i < numRays; i++) {
+			int32_t x = packetX + i;
+			int32_t cell = cells[i];
 			if (cell == 0)
 				continue;
-			distance = distance * (rayDirX * camDirX + rayDirY * camDirY);
+			float distance = distances[i] * (rayDirX[i] * camDirX + rayDirY[i] * camDirY);
 			float cellHeight = frameHalfHeight / distance;
-			Image *texture = wallTextures[cell - 1];
-			int32_t tx =
-					int32_t((hitX + hitY) * float(texture->width)) % texture->width;
-			uint32_t lightness =
-					uint32_t((1 - fmin(distance, lightDistance) / lightDistance) * 255);
-			frame.drawVerticalImageSlice(
-					*texture, x, int32_t(frameHalfHeight - cellHeight),
-					int32_t(frameHalfHeight + cellHeight), tx, lightness);
-			zbuffer[x] = distance;
+			int32_t ys = int32_t(frameHalfHeight - cellHeight), ye = int32_t(frameHalfHeight + cellHeight);
+			const TextureAtlasSlot &slot = getWallSlot(renderer, cell, ys, ye);
+			if (slot.width) {
+				int32_t tx = int32_t((hitX[i] + hitY[i]) * float(slot.width)) % slot.width;
+				uint32_t lightness =
+						uint32_t((1 - fmin(distance, lightDistance) / lightDistance) * 255);
+				drawWallSlice(renderer, slot, x, ys, ye, tx, uint8_t(lightness));
+			}
+			renderer.zbuffer[x] = distance;
+			LILRAY_STATS(wallPixels += (ye < frame.height ? ye : frame.height - 1) - (ys > 0 ? ys : 0) + 1);
+		}
+	}
+	LILRAY_STATS(counters.raysCast += raysCast; counters.ddaSteps += ddaSteps; counters.wallPixels += wallPixels);
+}
+
+// Fixed point version of renderWalls(), one ray per column.
+void renderWallsFixedPoint(Renderer &renderer, const FixedPointCamera &camera, Map &map, int32_t startX,
+						   int32_t endX, StatCounters &counters) {
+	// Only used if stats are enabled.
+	(void) counters;
+	Image &frame = renderer.frame;
+	int32_t frameHalfHeight = frame.height << (WORLD_FP_BITS - 1);
+	// The DDA clamps to MAX_FIXED_POINT_DISTANCE anyway, clamp before narrowing
+	// so diagonals of 32768 cells and more don't overflow.
+	int64_t mapDiagonal = int64_t(fixedSquareRoot(int64_t(map.width) * map.width + int64_t(map.height) * map.height))
+						  << WORLD_FP_BITS;
+	int32_t maxDistance = int32_t(mapDiagonal < MAX_FIXED_POINT_DISTANCE ? mapDiagonal : MAX_FIXED_POINT_DISTANCE);
+	int32_t *steps = nullptr;
+	LILRAY_STATS(int32_t numSteps; steps = &numSteps; int64_t raysCast = 0, ddaSteps = 0, wallPixels = 0);
+	for (int32_t x = startX; x < endX; x++) {
+		int32_t forward = renderer.columnRayForwardFixedPoint[x], right = renderer.columnRayRightFixedPoint[x];
+		int32_t rayDirX = fixedMultiply(forward, camera.dirX, WORLD_FP_BITS) +
+						  fixedMultiply(right, camera.rightX, WORLD_FP_BITS);
+		int32_t rayDirY = fixedMultiply(forward, camera.dirY, WORLD_FP_BITS) +
+						  fixedMultiply(right, camera.rightY, WORLD_FP_BITS);
+		int32_t hitX, hitY, distance;
+		int32_t cell = raycastDDAFixedPoint(map, camera.x, camera.y, rayDirX, rayDirY, maxDistance, hitX, hitY,
+											distance, steps);
+		LILRAY_STATS(raysCast++; ddaSteps += numSteps);
+		if (cell == 0)
+			continue;
+		distance = fixedMultiply(distance, forward, WORLD_FP_BITS);
+		if (distance < 1)
+			distance = 1;
+		// Half the slice height and its ends in WORLD_FP_BITS, divided so they
+		// truncate towards zero like the float path.
+		int64_t cellHeight = (int64_t(frameHalfHeight) << WORLD_FP_BITS) / distance;
+		int32_t ys = int32_t((frameHalfHeight - cellHeight) / WORLD_FP_ONE);
+		int32_t ye = int32_t((frameHalfHeight + cellHeight) / WORLD_FP_ONE);
+		const TextureAtlasSlot &slot = getWallSlot(renderer, cell, ys, ye);
+		if (slot.width) {
+			int32_t tx = int32_t((uint32_t((hitX + hitY) & (WORLD_FP_ONE - 1)) * uint32_t(slot.width)) >> WORLD_FP_BITS);
+			uint8_t lightness = uint8_t(255 - getDarknessFixedPoint(distance, camera.lightDistance));
+			drawWallSlice(renderer, slot, x, ys, ye, tx, lightness);
+		}
+		renderer.zbufferFixedPoint[x] = distance;
+		LILRAY_STATS(wallPixels += (ye < frame.height ? ye : frame.height - 1) - (ys > 0 ? ys : 0) + 1);
+	}
+	LILRAY_STATS(counters.raysCast += raysCast; counters.ddaSteps += ddaSteps; counters.wallPixels += wallPixels);
+}
+
+struct Pass {
+	Renderer *renderer;
+	Camera *camera;
+	Map *map;
+	float lightDistance;
+	FixedPointCamera fixedCamera;
+	StatCounters counters;
+};
+
+// Rebuilds the per column rays if the frame width or field of view changed.
+// The float path still normalizes the rotated ray per column, so it rounds
+// exactly like computing the offset per frame. The fixed point path only rotates
+// the normalized rays by the camera angle.
+static void updateColumnRays(Renderer &renderer, Camera &camera) {
+	int32_t width = renderer.frame.width;
+	if (width == renderer.columnRaysWidth && camera.fieldOfView == renderer.columnRaysFieldOfView)
+		return;
+	if (width != renderer.columnRaysWidth) {
+		delete[] renderer.columnRayOffsets;
+		delete[] renderer.columnRayForwardFixedPoint;
+		delete[] renderer.columnRayRightFixedPoint;
+		renderer.columnRayOffsets = new float[width];
+		renderer.columnRayForwardFixedPoint = new int32_t[width];
+		renderer.columnRayRightFixedPoint = new int32_t[width];
+	}
+	renderer.columnRaysWidth = width;
+	renderer.columnRaysFieldOfView = camera.fieldOfView;
+	renderer.projectionPlaneWidth = tanf(camera.fieldOfView / 2 * DEG_TO_RAD);
+	renderer.projectionPlaneWidthFixedPoint = floatToFixed(renderer.projectionPlaneWidth, WORLD_FP_BITS);
+	for (int32_t x = 0; x < width; x++) {
+		float offset = ((float(x) * 2.0f / (float(width) - 1.0f)) - 1.0f) * renderer.projectionPlaneWidth;
+		float length = sqrtf(1 + offset * offset);
+		renderer.columnRayOffsets[x] = offset;
+		renderer.columnRayForwardFixedPoint[x] = floatToFixed(1 / length, WORLD_FP_BITS);
+		renderer.columnRayRightFixedPoint[x] = floatToFixed(offset / length, WORLD_FP_BITS);
+	}
+}
+
+// Renders floor, ceiling and walls, filling the zbuffer.
+static void renderWorld(Renderer &renderer, Camera &camera, Map &map, float lightDistance) {
+	Image &frame = renderer.frame;
+	for (int i = 0; i < frame.width; i++)
+		renderer.zbuffer[i] = INFINITY;
+	matchFrameFormat(renderer);
+	updateColumnRays(renderer, camera);
+
+	Pass pass = {&renderer, &camera, &map, lightDistance, {}, {}};
+	if (renderer.useFixedPoint) {
+		pass.fixedCamera = getFixedPointCamera(camera, lightDistance);
+		for (int32_t i = 0; i < frame.width; i++)
+			renderer.zbufferFixedPoint[i] = INT32_MAX;
+	}
+	if (renderer.drawFloorAndCeiling && renderer.floorTexture && renderer.ceilingTexture) {
+		LILRAY_STATS(auto start = std::chrono::steady_clock::now());
+		renderBands(renderer, frame.height / 2, [](void *data, int32_t startY, int32_t endY) {
+			Pass &pass = *(Pass *) data;
+			if (!pass.renderer->useFixedPoint)
+				renderFloorAndCeiling(*pass.renderer, *pass.camera, pass.lightDistance, startY, endY);
+			else
+				renderFloorAndCeilingFixedPoint(*pass.renderer, pass.fixedCamera, startY, endY);
+		}, &pass);
+		LILRAY_STATS(renderer.stats.floorAndCeilingTime = getMillisSince(start);
+					 renderer.stats.floorAndCeilingPixels = int64_t(frame.width) * (frame.height / 2) * 2);
+	}
+
+	if (renderer.drawWalls) {
+		LILRAY_STATS(auto start = std::chrono::steady_clock::now());
+		renderBands(renderer, frame.width, [](void *data, int32_t startX, int32_t endX) {
+			Pass &pass = *(Pass *) data;
+			if (!pass.renderer->useFixedPoint)
+				renderWalls(*pass.renderer, *pass.camera, *pass.map, pass.lightDistance, startX, endX,
+							pass.counters);
+			else
+				renderWallsFixedPoint(*pass.renderer, pass.fixedCamera, *pass.map, startX, endX, pass.counters);
+		}, &pass);
+		LILRAY_STATS(RenderStats &stats = renderer.stats; stats.wallsTime = getMillisSince(start);
+					 stats.raysCast = pass.counters.raysCast; stats.ddaSteps = pass.counters.ddaSteps;
+					 stats.wallPixels = pass.counters.wallPixels);
+	}
+}
+
+struct SpriteView {
+	Camera *camera;
+	float camDirX, camDirY;
+	float projectionPlaneWidth;
+	// No wall column is farther away, so sprites beyond are fully occluded.
+	float farDistance;
+	float lightDistance;
+	// Only set for the fixed point path.
+	FixedPointCamera fixedCamera;
+	int32_t farDistanceFixedPoint;
+};
+
+static SpriteView getSpriteView(Renderer &renderer, Camera &camera, float lightDistance) {
+	SpriteView view;
+	view.camera = &camera;
+	view.camDirX = cosf(camera.angle * DEG_TO_RAD);
+	view.camDirY = sinf(camera.angle * DEG_TO_RAD);
+	view.projectionPlaneWidth = renderer.projectionPlaneWidth;
+	view.lightDistance = lightDistance;
+	view.farDistance = 0;
+	if (renderer.useFixedPoint) {
+		view.fixedCamera = getFixedPointCamera(camera, lightDistance);
+		view.farDistanceFixedPoint = 0;
+		for (int32_t i = 0; i < renderer.frame.width; i++) {
+			int32_t distance = renderer.zbufferFixedPoint[i];
+			view.farDistanceFixedPoint = distance > view.farDistanceFixedPoint ? distance : view.farDistanceFixedPoint;
+		}
+		// Still needed by the grid culling, which is float.
+		view.farDistance = view.farDistanceFixedPoint == INT32_MAX ? INFINITY
+																	: float(view.farDistanceFixedPoint) / WORLD_FP_ONE;
+		return view;
+	}
+	for (int32_t i = 0; i < renderer.frame.width; i++)
+		view.farDistance = renderer.zbuffer[i] > view.farDistance ? renderer.zbuffer[i] : view.farDistance;
+	return view;
+}
+
+static VisibleSprite &addVisibleSprite(Renderer &renderer) {
+	if (renderer.numVisibleSprites == renderer.maxVisibleSprites) {
+		int32_t maxVisibleSprites = renderer.maxVisibleSprites ? renderer.maxVisibleSprites * 2 : 64;
+		VisibleSprite *visibleSprites = new VisibleSprite[maxVisibleSprites];
+		if (renderer.numVisibleSprites)
+			memcpy(visibleSprites, renderer.visibleSprites, sizeof(VisibleSprite) * renderer.numVisibleSprites);
+		delete[] renderer.visibleSprites;
+		renderer.visibleSprites = visibleSprites;
+		renderer.maxVisibleSprites = maxVisibleSprites;
+	}
+	return renderer.visibleSprites[renderer.numVisibleSprites++];
+}
+
+// Clamps a PIXEL_FP_BITS coordinate of a sprite right in front of the camera,
+// so the rectangle's size still fits 32 bits.
+static inline int32_t clampSpriteCoordinate(int64_t v) {
+	const int64_t maxCoordinate = int64_t(1) << 29;
+	return int32_t(v < -maxCoordinate ? -maxCoordinate : v > maxCoordinate ? maxCoordinate : v);
+}
+
+// Fixed point version of addVisibleSprite(). The depth along the view direction
+// and the lateral offset replace the angle to the sprite, so no trigonometry is
+// needed.
+static void addVisibleSpriteFixedPoint(Renderer &renderer, SpriteView &view, Sprite *sprite) {
+	FixedPointCamera &camera = view.fixedCamera;
+	int32_t viewDirX = floatToFixed(sprite->x, WORLD_FP_BITS) - camera.x;
+	int32_t viewDirY = floatToFixed(sprite->y, WORLD_FP_BITS) - camera.y;
+	int32_t depth = fixedMultiply(viewDirX, camera.dirX, WORLD_FP_BITS) +
+					fixedMultiply(viewDirY, camera.dirY, WORLD_FP_BITS);
+	if (depth <= 0 || depth > view.farDistanceFixedPoint)
+		return;
+	int32_t lateral = fixedMultiply(viewDirX, camera.rightX, WORLD_FP_BITS) +
+					  fixedMultiply(viewDirY, camera.rightY, WORLD_FP_BITS);
+	int32_t planeWidth = fixedMultiply(depth, renderer.projectionPlaneWidthFixedPoint, WORLD_FP_BITS);
+	if (planeWidth < 1)
+		planeWidth = 1;
+
+	// Screen coordinates in WORLD_FP_BITS.
+	int64_t frameHalfWidth = int64_t(renderer.frame.width) << (WORLD_FP_BITS - 1);
+	int64_t frameHalfHeight = int64_t(renderer.frame.height) << (WORLD_FP_BITS - 1);
+	int64_t halfUnitHeight = (frameHalfHeight << WORLD_FP_BITS) / depth;
+	int64_t screenHeight = (halfUnitHeight * 2 * floatToFixed(sprite->height, WORLD_FP_BITS)) >> WORLD_FP_BITS;
+	int64_t screenWidth = screenHeight * sprite->image->width / sprite->image->height;
+	int64_t x = frameHalfWidth + int64_t(lateral) * frameHalfWidth / planeWidth - screenWidth / 2;
+	if (x + screenWidth < 0 || x >= int64_t(renderer.frame.width) << WORLD_FP_BITS)
+		return;
+	int64_t y = frameHalfHeight + halfUnitHeight - screenHeight;
+
+	VisibleSprite &visible = addVisibleSprite(renderer);
+	const int32_t toPixelBits = WORLD_FP_BITS - PIXEL_FP_BITS;
+	visible.sprite = sprite;
+	visible.minX = fixedRound(clampSpriteCoordinate(x >> toPixelBits), PIXEL_FP_BITS);
+	visible.minY = fixedRound(clampSpriteCoordinate(y >> toPixelBits), PIXEL_FP_BITS);
+	visible.maxX = clampSpriteCoordinate((x + screenWidth) >> toPixelBits);
+	visible.maxY = clampSpriteCoordinate((y + screenHeight) >> toPixelBits);
+	visible.depthFixedPoint = depth;
+	visible.sortKey = uint64_t(int64_t(viewDirX) * viewDirX + int64_t(viewDirY) * viewDirY);
+}
+
+// Adds the sprite to the visible sprites unless it is behind the camera, off
+// screen, or farther away than every wall.
+static void addVisibleSprite(Renderer &renderer, SpriteView &view, Sprite *sprite) {
+	if (renderer.useFixedPoint) {
+		addVisibleSpriteFixedPoint(renderer, view, sprite);
+		return;
+	}
+	Camera &camera = *view.camera;
+	float viewDirX = sprite->x - camera.x, viewDirY = sprite->y - camera.y;
+	if (viewDirX * view.camDirX + viewDirY * view.camDirY < 0)
+		return;
+	float spriteDistance = distance(sprite->x, sprite->y, camera.x, camera.y);
+	float viewAngle = atan2f(viewDirY, viewDirX) * RAD_TO_DEG - camera.angle;
+	float depth = spriteDistance * cosf(viewAngle * DEG_TO_RAD);
+	if (depth > view.farDistance)
+		return;
+	float frameHalfWidth = float(renderer.frame.width) / 2.0f;
+	float frameHalfHeight = float(renderer.frame.height) / 2.0f;
+	float halfUnitHeight = frameHalfHeight / depth;
+	float screenHeight = halfUnitHeight * 2 * sprite->height;
+	float screenWidth = screenHeight * (float(sprite->image->width) /
+										float(sprite->image->height));
+	float xc = (tanf(viewAngle * DEG_TO_RAD) / view.projectionPlaneWidth *
+						frameHalfWidth +
+				frameHalfWidth);
+	float x = xc - screenWidth / 2;
+	if (x + screenWidth < 0 || x >= float(renderer.frame.width))
+		return;
+
+	VisibleSprite &visible = addVisibleSprite(renderer);
+	float y = frameHalfHeight + halfUnitHeight - screenHeight;
+	visible.sprite = sprite;
+	visible.minX = fixedRound(floatToFixed(x, PIXEL_FP_BITS), PIXEL_FP_BITS);
+	visible.minY = fixedRound(floatToFixed(y, PIXEL_FP_BITS), PIXEL_FP_BITS);
+	visible.maxX = floatToFixed(x + screenWidth, PIXEL_FP_BITS);
+	visible.maxY = floatToFixed(y + screenHeight, PIXEL_FP_BITS);
+	visible.depth = depth;
+	// Positive floats order the same as their bits.
+	uint32_t distanceBits;
+	memcpy(&distanceBits, &spriteDistance, sizeof(distanceBits));
+	visible.sortKey = distanceBits;
+}
+
+// Sorts order by sortKey, near to far. Gives up and returns false if the
+// order is too far from sorted, e.g. after the camera turned around.
+static bool insertionSortSprites(VisibleSprite *visible, int32_t *order, int32_t numSprites) {
+	int32_t moves = 0, maxMoves = numSprites * 8;
+	for (int32_t i = 1; i < numSprites; i++) {
+		int32_t index = order[i];
+		uint64_t key = visible[index].sortKey;
+		int32_t j = i;
+		while (j > 0 && visible[order[j - 1]].sortKey > key) {
+			order[j] = order[j - 1];
+			j--;
 		}
+		order[j] = index;
+		moves += i - j;
+		if (moves > maxMoves)
+			return false;
 	}
+	return true;
+}
+
+// LSD radix sort of order by sortKey, a byte per pass. Passes where all keys
+// share the byte are skipped, so float keys take at most four.
+static void radixSortSprites(Renderer &renderer, int32_t numSprites) {
+	VisibleSprite *visible = renderer.visibleSprites;
+	int32_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (int32_t i = 0; i < numSprites; i++) {
+		uint64_t key = visible[i].sortKey;
+		for (int32_t pass = 0; pass < 8; pass++)
+			counts[pass][(key >> (pass * 8)) & 0xff]++;
+	}
+	uint64_t firstKey = visible[0].sortKey;
+	for (int32_t pass = 0; pass < 8; pass++) {
+		int32_t shift = pass * 8;
+		int32_t *passCounts = counts[pass];
+		if (passCounts[(firstKey >> shift) & 0xff] == numSprites)
+			continue;
+		int32_t offset = 0;
+		for (int32_t i = 0; i < 256; i++) {
+			int32_t count = passCounts[i];
+			passCounts[i] = offset;
+			offset += count;
+		}
+		int32_t *order = renderer.spriteOrder, *sorted = renderer.spriteOrderScratch;
+		for (int32_t i = 0; i < numSprites; i++) {
+			int32_t index = order[i];
+			sorted[passCounts[(visible[index].sortKey >> shift) & 0xff]++] = index;
+		}
+		renderer.spriteOrder = sorted;
+		renderer.spriteOrderScratch = order;
+	}
+}
+
+// Sorts the visible sprites into renderer.spriteOrder. If the same sprites
+// were visible last frame, their order then is almost always still close,
+// so insertion sort starts from it. Otherwise, or if that takes too many
+// moves, the order is radix sorted.
+static void sortVisibleSprites(Renderer &renderer) {
+	int32_t numSprites = renderer.numVisibleSprites;
+	bool coherent = numSprites == renderer.numSortedSprites;
+	if (numSprites > renderer.maxSortedSprites) {
+		delete[] renderer.spriteOrder;
+		delete[] renderer.spriteOrderScratch;
+		delete[] renderer.sortedSprites;
+		renderer.maxSortedSprites = renderer.maxVisibleSprites;
+		renderer.spriteOrder = new int32_t[renderer.maxSortedSprites];
+		renderer.spriteOrderScratch = new int32_t[renderer.maxSortedSprites];
+		renderer.sortedSprites = new Sprite *[renderer.maxSortedSprites];
+		coherent = false;
+	}
+	for (int32_t i = 0; i < numSprites; i++) {
+		Sprite *sprite = renderer.visibleSprites[i].sprite;
+		coherent &= renderer.sortedSprites[i] == sprite;
+		renderer.sortedSprites[i] = sprite;
+	}
+	renderer.numSortedSprites = numSprites;
+	if (numSprites < 2)
+		coherent = false;
+	if (!coherent) {
+		for (int32_t i = 0; i < numSprites; i++)
+			renderer.spriteOrder[i] = i;
+	}
+	if ((coherent || numSprites <= 16) &&
+		insertionSortSprites(renderer.visibleSprites, renderer.spriteOrder, numSprites))
+		return;
+	radixSortSprites(renderer, numSprites);
+}
+
+static void drawVisibleSprites(Renderer &renderer, SpriteView &view) {
+	LILRAY_STATS(auto sortStart = std::chrono::steady_clock::now());
+	sortVisibleSprites(renderer);
+	LILRAY_STATS(renderer.stats.spriteSortTime = getMillisSince(sortStart);
+				 renderer.stats.spritesSorted = renderer.numVisibleSprites);
+	float lightDistance = view.lightDistance;
+	// Back to front.
+	for (int32_t i = renderer.numVisibleSprites - 1; i >= 0; i--) {
+		VisibleSprite &visible = renderer.visibleSprites[renderer.spriteOrder[i]];
+		Sprite *sprite = visible.sprite;
+		uint8_t lightness;
+		if (renderer.useFixedPoint) {
+			// Sprites keep at least a fifth of their brightness, 51 / 255.
+			int32_t darkness = getDarknessFixedPoint(visible.depthFixedPoint, view.fixedCamera.lightDistance);
+			lightness = uint8_t(255 - (darkness > 51 ? darkness : 51));
+		} else {
+			lightness = uint8_t((1 - fmax(0.2, fmin(visible.depth, lightDistance) / lightDistance)) * 255);
+		}
+		const uint32_t *colorMap =
+				isPaletteActive(renderer, sprite->image) ? getColorMap(renderer, lightness) : nullptr;
+		drawVisibleSprite(renderer, visible, lightness, colorMap);
+	}
+}
+
+// Conservative test whether any sprite standing in the cell can end up on
+// screen. margin is the largest sprite half width, measured as distance from
+// the frustum's side planes.
+static bool isCellVisible(SpriteView &view, int32_t cellX, int32_t cellY, float margin) {
+	Camera &camera = *view.camera;
+	float camRightX = -view.camDirY, camRightY = view.camDirX;
+	bool front = false, near = false, left = false, right = false;
+	for (int32_t i = 0; i < 4; i++) {
+		float dx = float(cellX + (i & 1)) - camera.x, dy = float(cellY + (i >> 1)) - camera.y;
+		float depth = dx * view.camDirX + dy * view.camDirY;
+		float lateral = dx * camRightX + dy * camRightY;
+		float extent = depth * view.projectionPlaneWidth + margin;
+		front |= depth >= 0;
+		near |= depth <= view.farDistance;
+		left |= lateral >= -extent;
+		right |= lateral <= extent;
+	}
+	return front && near && left && right;
+}
+
+#ifdef LILRAY_ENABLE_STATS
+static void finishFrameStats(Renderer &renderer, std::chrono::steady_clock::time_point frameStart) {
+	RenderStats &stats = renderer.stats;
+	stats.totalTime = getMillisSince(frameStart);
+	stats.overdraw = float(stats.floorAndCeilingPixels + stats.wallPixels + stats.spritePixels) /
+					 float(renderer.frame.width * renderer.frame.height);
+}
+#endif
+
+void Renderer::render(Camera &camera, Map &map, Sprite **sprites,
+					  int32_t numSprites, float lightDistance) {
+	LILRAY_STATS(stats = RenderStats(); auto frameStart = std::chrono::steady_clock::now());
+	renderWorld(*this, camera, map, lightDistance);
 
 	if (drawSprites) {
-		for (int i = 0; i < numSprites; i++) {
-			Sprite *sprite = sprites[i];
-			sprite->distance = distance(sprite->x, sprite->y, camera.x, camera.y);
-		}
-		qsort(sprites, numSprites, sizeof(Sprite *), &spriteCompare);
-		for (int i = 0; i < numSprites; i++) {
-			Sprite *sprite = sprites[i];
-			float viewDirX = sprite->x - camera.x, viewDirY = sprite->y - camera.y;
-			if (viewDirX * camDirX + viewDirY * camDirY < 0)
-				continue;
-			float viewAngle = atan2f(viewDirY, viewDirX) * RAD_TO_DEG - camera.angle;
-			float distance = sprite->distance * cosf(viewAngle * DEG_TO_RAD);
-			uint8_t lightness = uint8_t(
-					(1 - fmax(0.2, fmin(distance, lightDistance) / lightDistance)) * 255);
-			float halfUnitHeight = frameHalfHeight / distance;
-			float screenHeight = halfUnitHeight * 2 * sprite->height;
-			float screenWidth = screenHeight * (float(sprite->image->width) /
-												float(sprite->image->height));
-			float xc = (tanf(viewAngle * DEG_TO_RAD) / projectionPlaneWidth *
-								frameHalfWidth +
-						frameHalfWidth);
-			float x = xc - screenWidth / 2;
-			float y = frameHalfHeight + halfUnitHeight - screenHeight;
-			drawSprite(&frame, sprite->image, x, y, screenWidth, screenHeight,
-					   lightness, zbuffer, distance);
+		LILRAY_STATS(auto start = std::chrono::steady_clock::now());
+		SpriteView view = getSpriteView(*this, camera, lightDistance);
+		numVisibleSprites = 0;
+		for (int32_t i = 0; i < numSprites; i++)
+			addVisibleSprite(*this, view, sprites[i]);
+		drawVisibleSprites(*this, view);
+		LILRAY_STATS(stats.spritesCulled = numSprites - stats.spritesDrawn; stats.spritesTime = getMillisSince(start));
+	}
+	LILRAY_STATS(finishFrameStats(*this, frameStart));
+}
+
+void Renderer::render(Camera &camera, Map &map, SpriteGrid &sprites, float lightDistance) {
+	LILRAY_STATS(stats = RenderStats(); auto frameStart = std::chrono::steady_clock::now());
+	renderWorld(*this, camera, map, lightDistance);
+
+	if (drawSprites) {
+		LILRAY_STATS(auto start = std::chrono::steady_clock::now());
+		SpriteView view = getSpriteView(*this, camera, lightDistance);
+		float margin = sprites.maxSpriteWidth * view.projectionPlaneWidth * float(frame.height) / float(frame.width);
+
+		// Bounds of the frustum triangle up to the farthest wall, or the whole
+		// grid if some column doesn't hit a wall.
+		int32_t minX = 0, minY = 0, maxX = sprites.width - 1, maxY = sprites.height - 1;
+		if (view.farDistance < INFINITY) {
+			float camRightX = -view.camDirY, camRightY = view.camDirX;
+			float edgeX = camRightX * view.projectionPlaneWidth, edgeY = camRightY * view.projectionPlaneWidth;
+			float leftX = camera.x + (view.camDirX - edgeX) * view.farDistance;
+			float leftY = camera.y + (view.camDirY - edgeY) * view.farDistance;
+			float rightX = camera.x + (view.camDirX + edgeX) * view.farDistance;
+			float rightY = camera.y + (view.camDirY + edgeY) * view.farDistance;
+			float border = margin + 1;
+			minX = int32_t(fmaxf(0, floorf(fminf(camera.x, fminf(leftX, rightX)) - border)));
+			minY = int32_t(fmaxf(0, floorf(fminf(camera.y, fminf(leftY, rightY)) - border)));
+			maxX = int32_t(fminf(float(sprites.width - 1), ceilf(fmaxf(camera.x, fmaxf(leftX, rightX)) + border)));
+			maxY = int32_t(fminf(float(sprites.height - 1), ceilf(fmaxf(camera.y, fmaxf(leftY, rightY)) + border)));
 		}
+
+		numVisibleSprites = 0;
+		for (int32_t y = minY; y <= maxY; y++) {
+			int32_t *cellStarts = sprites.cellStarts + y * sprites.width;
+			for (int32_t x = minX; x <= maxX; x++) {
+				int32_t start = cellStarts[x], end = cellStarts[x + 1];
+				if (start == end || !isCellVisible(view, x, y, margin))
+					continue;
+				for (int32_t i = start; i < end; i++)
+					addVisibleSprite(*this, view, sprites.sprites[i]);
+			}
+		}
+		// Sprites outside the grid have no cell to test, cull them one by one.
+		int32_t overflowStart = sprites.cellStarts[sprites.width * sprites.height];
+		for (int32_t i = overflowStart; i < sprites.numSprites; i++)
+			addVisibleSprite(*this, view, sprites.sprites[i]);
+		drawVisibleSprites(*this, view);
+		LILRAY_STATS(stats.spritesCulled = sprites.numSprites - stats.spritesDrawn;
+					 stats.spritesTime = getMillisSince(start));
+	}
+	LILRAY_STATS(finishFrameStats(*this, frameStart));
+}
+
+struct RenderViewsTask {
+	Renderer **views;
+	Camera **cameras;
+	Map *map;
+	Sprite **sprites;
+	int32_t numSprites;
+	float lightDistance;
+};
+
+static void renderViewTask(void *data, int32_t index) {
+	RenderViewsTask &task = *(RenderViewsTask *) data;
+	task.views[index]->render(*task.cameras[index], *task.map, task.sprites, task.numSprites, task.lightDistance);
+}
+
+void Renderer::renderViews(int32_t numViews, Camera *cameras[], Image *frames[], Map &map, Sprite *sprites[],
+						   int32_t numSprites, float lightDistance) {
+	if (numViews <= 0)
+		return;
+	// The views share the copies converted below. A view with another format
+	// would rebuild them while the other views read them.
+	for (int32_t i = 1; i < numViews; i++) {
+		if (frames[i]->format != frames[0]->format)
+			return;
+	}
+	LILRAY_STATS(stats = RenderStats(); auto frameStart = std::chrono::steady_clock::now());
+
+	// Convert everything the views share up front, the views then only read it.
+	matchFormat(*this, frames[0]->format);
+
+	if (numViews > numViewRenderers) {
+		Renderer **newViews = new Renderer *[numViews];
+		for (int32_t i = 0; i < numViewRenderers; i++)
+			newViews[i] = viewRenderers[i];
+		for (int32_t i = numViewRenderers; i < numViews; i++)
+			newViews[i] = new Renderer(frames[i]->width, frames[i]->height, nullptr, 0, nullptr, nullptr);
+		delete[] viewRenderers;
+		viewRenderers = newViews;
+		numViewRenderers = numViews;
+	}
+	for (int32_t i = 0; i < numViews; i++) {
+		Renderer &view = *viewRenderers[i];
+		Image *frame = frames[i];
+		view.setRenderTarget(frame->pixels, frame->width, frame->height, frame->pitch, frame->format);
+		view.wallTextures = wallTextures;
+		view.numWallTextures = numWallTextures;
+		view.wallAtlas = wallAtlas;
+		view.floorTextureCopy = floorTextureCopy;
+		view.ceilingTextureCopy = ceilingTextureCopy;
+		view.colorMaps = colorMaps;
+		view.colorMapsPalette = colorMapsPalette;
+		view.textureCopiesHaveMipmaps = textureCopiesHaveMipmaps;
+		view.floorTexture = floorTexture;
+		view.ceilingTexture = ceilingTexture;
+		view.useFixedPoint = useFixedPoint;
+		view.useSimd = useSimd;
+		view.useMipmaps = useMipmaps;
+		view.usePalette = usePalette;
+		view.palette = palette;
+		view.drawWalls = drawWalls;
+		view.drawFloorAndCeiling = drawFloorAndCeiling;
+		view.drawSprites = drawSprites;
+	}
+
+	// One view per thread, each view renders its frame single threaded.
+	RenderViewsTask task = {viewRenderers, cameras, &map, sprites, numSprites, lightDistance};
+	if (threadPool)
+		threadPool->run(numViews, renderViewTask, &task);
+	else
+		for (int32_t i = 0; i < numViews; i++)
+			renderViewTask(&task, i);
+
+#ifdef LILRAY_ENABLE_STATS
+	int64_t numPixels = 0;
+	for (int32_t i = 0; i < numViews; i++) {
+		RenderStats &view = viewRenderers[i]->stats;
+		stats.floorAndCeilingTime += view.floorAndCeilingTime;
+		stats.wallsTime += view.wallsTime;
+		stats.spritesTime += view.spritesTime;
+		stats.spriteSortTime += view.spriteSortTime;
+		stats.raysCast += view.raysCast;
+		stats.ddaSteps += view.ddaSteps;
+		stats.floorAndCeilingPixels += view.floorAndCeilingPixels;
+		stats.wallPixels += view.wallPixels;
+		stats.spritePixels += view.spritePixels;
+		stats.spritesCulled += view.spritesCulled;
+		stats.spritesDrawn += view.spritesDrawn;
+		stats.spritesSorted += view.spritesSorted;
+		numPixels += int64_t(frames[i]->width) * frames[i]->height;
+	}
+	stats.totalTime = getMillisSince(frameStart);
+	stats.overdraw = float(stats.floorAndCeilingPixels + stats.wallPixels + stats.spritePixels) / float(numPixels);
+#endif
+}
+
+enum RenderPipelineFrameState {
+	FRAME_FREE,
+	FRAME_QUEUED,
+	FRAME_RENDERING,
+	FRAME_READY,
+	FRAME_ACQUIRED
+};
+
+// A submitted frame, rendered into the pipeline buffer with the same index.
+struct RenderPipelineFrame {
+	RenderPipelineFrameState state;
+	// Frames are rendered and acquired in submission order.
+	uint64_t sequence;
+	Camera camera;
+	Map *map;
+	Sprite *sprites;
+	Sprite **spritePointers;
+	int32_t numSprites;
+	int32_t maxSprites;
+	float lightDistance;
+
+	RenderPipelineFrame()
+		: state(FRAME_FREE), sequence(0), camera(0, 0, 0, 0), map(nullptr), sprites(nullptr),
+		  spritePointers(nullptr), numSprites(0), maxSprites(0), lightDistance(0) {}
+
+	~RenderPipelineFrame() {
+		delete[] sprites;
+		delete[] spritePointers;
+	}
+};
+
+struct lilray::RenderPipelineState {
+	RenderPipelineFrame *frames;
+	uint64_t nextSequence;
+#ifndef LILRAY_NO_THREADS
+	std::thread worker;
+	std::mutex mutex;
+	// Notified whenever a frame changes state.
+	std::condition_variable changed;
+	bool quit;
+#endif
+};
+
+// Index of the oldest frame in one of the states in stateMask, -1 if there is none.
+static int32_t findOldestFrame(RenderPipeline &pipeline, uint32_t stateMask) {
+	int32_t oldest = -1;
+	for (int32_t i = 0; i < pipeline.numBuffers; i++) {
+		RenderPipelineFrame &frame = pipeline.state->frames[i];
+		if (!((1 << frame.state) & stateMask))
+			continue;
+		if (oldest < 0 || frame.sequence < pipeline.state->frames[oldest].sequence)
+			oldest = i;
+	}
+	return oldest;
+}
+
+// A free buffer, or the one of the oldest frame that wasn't acquired yet.
+static int32_t findSubmitFrame(RenderPipeline &pipeline) {
+	int32_t index = findOldestFrame(pipeline, 1 << FRAME_FREE);
+	return index >= 0 ? index : findOldestFrame(pipeline, 1 << FRAME_READY);
+}
+
+static void setFrame(RenderPipelineFrame &frame, Camera &camera, Map &map, Sprite *sprites[], int32_t numSprites,
+					 float lightDistance) {
+	if (numSprites > frame.maxSprites) {
+		delete[] frame.sprites;
+		delete[] frame.spritePointers;
+		frame.sprites = new Sprite[numSprites];
+		frame.spritePointers = new Sprite *[numSprites];
+		frame.maxSprites = numSprites;
+	}
+	for (int32_t i = 0; i < numSprites; i++) {
+		frame.sprites[i] = *sprites[i];
+		frame.spritePointers[i] = &frame.sprites[i];
+	}
+	frame.camera = camera;
+	frame.map = &map;
+	frame.numSprites = numSprites;
+	frame.lightDistance = lightDistance;
+}
+
+static void renderFrame(RenderPipeline &pipeline, int32_t index) {
+	RenderPipelineFrame &frame = pipeline.state->frames[index];
+	Image *buffer = pipeline.buffers[index];
+	pipeline.renderer->setRenderTarget(buffer->pixels, buffer->width, buffer->height, buffer->pitch, buffer->format);
+	pipeline.renderer->render(frame.camera, *frame.map, frame.spritePointers, frame.numSprites,
+							  frame.lightDistance);
+}
+
+#ifndef LILRAY_NO_THREADS
+static void renderPipelineLoop(RenderPipeline *pipeline) {
+	RenderPipelineState *state = pipeline->state;
+	std::unique_lock<std::mutex> lock(state->mutex);
+	while (true) {
+		int32_t index = -1;
+		state->changed.wait(lock, [&] {
+			index = findOldestFrame(*pipeline, 1 << FRAME_QUEUED);
+			return state->quit || index >= 0;
+		});
+		if (index < 0)
+			return;
+		state->frames[index].state = FRAME_RENDERING;
+		lock.unlock();
+
+		renderFrame(*pipeline, index);
+
+		lock.lock();
+		state->frames[index].state = FRAME_READY;
+		state->changed.notify_all();
+		if (pipeline->frameReady) {
+			lock.unlock();
+			pipeline->frameReady(pipeline->frameReadyData, pipeline->buffers[index]);
+			lock.lock();
+		}
+	}
+}
+#endif
+
+RenderPipeline::RenderPipeline(Renderer *renderer, int32_t numBuffers)
+	: renderer(renderer), numBuffers(numBuffers < 2 ? 2 : numBuffers), buffers(nullptr), frameReady(nullptr),
+	  frameReadyData(nullptr), state(new RenderPipelineState()) {
+	Image &frame = renderer->frame;
+	buffers = new Image *[this->numBuffers];
+	for (int32_t i = 0; i < this->numBuffers; i++) {
+		buffers[i] = new Image(frame.width, frame.height);
+		buffers[i]->format = frame.format;
+	}
+	state->frames = new RenderPipelineFrame[this->numBuffers];
+	state->nextSequence = 0;
+#ifndef LILRAY_NO_THREADS
+	state->quit = false;
+	state->worker = std::thread(renderPipelineLoop, this);
+#endif
+}
+
+RenderPipeline::~RenderPipeline() {
+#ifndef LILRAY_NO_THREADS
+	// The worker renders the queued frames before it quits.
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->quit = true;
 	}
+	state->changed.notify_all();
+	state->worker.join();
+#endif
+	Image &frame = renderer->frame;
+	renderer->setRenderTarget(nullptr, frame.width, frame.height, frame.width, frame.format);
+	for (int32_t i = 0; i < numBuffers; i++)
+		delete buffers[i];
+	delete[] buffers;
+	delete[] state->frames;
+	delete state;
+}
+
+void RenderPipeline::submit(Camera &camera, Map &map, Sprite *sprites[], int32_t numSprites, float lightDistance) {
+#ifndef LILRAY_NO_THREADS
+	std::unique_lock<std::mutex> lock(state->mutex);
+	int32_t index = -1;
+	state->changed.wait(lock, [&] {
+		index = findSubmitFrame(*this);
+		return index >= 0;
+	});
+	RenderPipelineFrame &frame = state->frames[index];
+	setFrame(frame, camera, map, sprites, numSprites, lightDistance);
+	frame.sequence = state->nextSequence++;
+	frame.state = FRAME_QUEUED;
+	state->changed.notify_all();
+#else
+	int32_t index = findSubmitFrame(*this);
+	RenderPipelineFrame &frame = state->frames[index];
+	setFrame(frame, camera, map, sprites, numSprites, lightDistance);
+	frame.sequence = state->nextSequence++;
+	renderFrame(*this, index);
+	frame.state = FRAME_READY;
+	if (frameReady)
+		frameReady(frameReadyData, buffers[index]);
+#endif
+}
+
+Image *RenderPipeline::acquire(bool wait) {
+	const uint32_t pending = (1 << FRAME_QUEUED) | (1 << FRAME_RENDERING) | (1 << FRAME_READY);
+#ifndef LILRAY_NO_THREADS
+	std::unique_lock<std::mutex> lock(state->mutex);
+	int32_t index = findOldestFrame(*this, pending);
+	if (index < 0)
+		return nullptr;
+	// Only submit() takes frames away, and it runs on the calling thread.
+	if (wait)
+		state->changed.wait(lock, [&] { return state->frames[index].state == FRAME_READY; });
+#else
+	int32_t index = findOldestFrame(*this, pending);
+	if (index < 0)
+		return nullptr;
+#endif
+	if (state->frames[index].state != FRAME_READY)
+		return nullptr;
+	// The previously acquired frame's buffer can be rendered into again.
+	for (int32_t i = 0; i < numBuffers; i++) {
+		if (state->frames[i].state == FRAME_ACQUIRED)
+			state->frames[i].state = FRAME_FREE;
+	}
+	state->frames[index].state = FRAME_ACQUIRED;
+#ifndef LILRAY_NO_THREADS
+	state->changed.notify_all();
+#endif
+	return buffers[index];
+}
+
+void RenderPipeline::finish() {
+#ifndef LILRAY_NO_THREADS
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->changed.wait(lock, [&] {
+		return findOldestFrame(*this, (1 << FRAME_QUEUED) | (1 << FRAME_RENDERING)) < 0;
+	});
+#endif
 }
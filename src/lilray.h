@@ -5,10 +5,42 @@
 
 namespace lilray {
 	struct Font;
+	struct Palette;
+
+	// Channel order of a pixel, from the most to the least significant byte.
+	// Images are loaded as ARGB. ABGR is R, G, B, A in memory on little endian
+	// machines, e.g. canvas ImageData.
+	enum PixelFormat {
+		PIXEL_FORMAT_ARGB,
+		PIXEL_FORMAT_ABGR,
+		PIXEL_FORMAT_RGBA
+	};
 
 	struct Image {
 		int32_t width, height;
+		// Pixels per row, only differs from width for render targets.
+		int32_t pitch;
+		PixelFormat format;
+		// False if pixels are owned by the caller and not deleted with the image.
+		bool ownsPixels;
 		uint32_t *pixels;
+		// Optional transposed copy of pixels, column x starts at x * height.
+		uint32_t *columnPixels;
+		// Optional palette indices created by quantize(), in the same layouts
+		// as pixels and columnPixels. Index 0 is transparent.
+		uint8_t *indices;
+		uint8_t *columnIndices;
+		// Optional mip chain created by createMipmaps(). Each level is half the
+		// size of the previous one, down to 1x1, and has columnPixels and indices
+		// if this image has them. mipmaps[0] is the first level below this image.
+		Image **mipmaps;
+		int32_t numMipmaps;
+		// Optional runs of opaque texels per column created by createPosts(), so
+		// sprites skip transparent texels in bulk. Post i covers the rows
+		// [posts[i * 2], posts[i * 2 + 1]), the posts of column x are
+		// postStarts[x] to postStarts[x + 1].
+		int32_t *posts;
+		int32_t *postStarts;
 
 		explicit Image(const char *imageFile);
 
@@ -16,16 +48,55 @@ namespace lilray {
 
 		Image(int32_t width, int32_t height, const uint32_t *pixels = nullptr);
 
+		// Uses pixels without copying them. Unless ownsPixels is true, the caller
+		// keeps ownership and pixels have to outlive the image. Owned pixels must
+		// be allocated with new[].
+		Image(int32_t width, int32_t height, uint32_t *pixels, bool ownsPixels);
+
 		~Image();
 
+		// Creates columnPixels, so vertical slices read texels sequentially. Call
+		// again after modifying pixels.
+		void createColumnPixels();
+
+		// Converts pixels, columnPixels and mipmaps to the format in place.
+		void setFormat(PixelFormat format);
+
+		// Maps every pixel to the nearest palette color. Also creates columnIndices
+		// if the image has columnPixels, and quantizes the mipmaps.
+		void quantize(Palette &palette);
+
+		// Creates mipmaps by averaging 2x2 texels. Call again after modifying
+		// pixels, and call quantize() again afterwards if the image has indices.
+		void createMipmaps();
+
+		// Level 0 is the image itself, levels past the last mipmap return the
+		// last one.
+		Image *getMipmap(int32_t level);
+
+		// Creates posts from the pixels, a texel of 0 is transparent. Call again
+		// after modifying pixels.
+		void createPosts();
+
+		// Returns a copy converted to the format, with columnPixels, indices,
+		// mipmaps and posts if this image has them.
+		Image *copy(PixelFormat format);
+
 		Image *getRegion(int32_t x, int32_t y, int32_t w, int32_t h);
 
+		// Colors passed to the drawing methods are ARGB, regardless of format.
 		void clear(uint32_t clearColor);
 
 		void drawVerticalLine(int32_t x, int32_t ys, int32_t ye, uint32_t color);
 
+		// With useFixedPoint, texels are stepped in fixed point instead of float, which
+		// avoids a float to int conversion per pixel and doesn't drift on tall slices.
+		void drawVerticalImageSlice(Image &texture, int32_t x, int32_t ys, int32_t ye, int32_t tx,
+									uint8_t lightness, bool useFixedPoint = false);
+
+		// Draws the slice from the texture's palette indices, shaded by colorMap.
 		void drawVerticalImageSlice(Image &texture, int32_t x, int32_t ys, int32_t ye, int32_t tx,
-									uint8_t lightness);
+									const uint32_t *colorMap, bool useFixedPoint = false);
 
 		void drawRectangle(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color);
 
@@ -34,6 +105,68 @@ namespace lilray {
 		void reverseColorChannels();
 	};
 
+	struct TextureAtlasSlot {
+		int32_t width, height;
+		// Index of the first texel of column 0 in pixels and indices. Columns
+		// follow each other, column x starts at offset + x * height.
+		int32_t offset;
+	};
+
+	// Packs the texels of a set of textures and all their mip levels column by
+	// column into one contiguous block, every slot starting on a cache line.
+	// Texture i is looked up as cell i + 1, so a wall cell maps to its texels
+	// with a single table lookup. Built from the images' current pixels and
+	// indices, with the pixels converted to format.
+	struct TextureAtlas {
+		PixelFormat format;
+		uint32_t *pixels;
+		// Palette indices in the same layout, nullptr unless all textures and
+		// mip levels have indices.
+		uint8_t *indices;
+		int32_t numTextures;
+		// Slots per texture, the full size image and its mipmaps. Levels past
+		// a texture's last mipmap repeat the last one.
+		int32_t numLevels;
+		// numTextures + 1 rows of numLevels slots, row 0 is empty.
+		TextureAtlasSlot *slots;
+		// The unaligned allocation holding pixels and indices.
+		uint8_t *block;
+
+		TextureAtlas(Image **textures, int32_t numTextures, PixelFormat format);
+
+		~TextureAtlas();
+
+		const TextureAtlasSlot &getSlot(int32_t cell, int32_t level) const {
+			return slots[cell * numLevels + (level < numLevels ? level : numLevels - 1)];
+		}
+	};
+
+	// Doom style 8-bit palette plus one color map per light level, mapping
+	// palette indices to shaded colors. Index 0 is reserved for transparent
+	// texels.
+	struct Palette {
+		uint32_t colors[256];
+		int32_t numColors;
+		int32_t numLightLevels;
+		// colors are always ARGB, colorMaps are in format.
+		PixelFormat format;
+		uint32_t *colorMaps;
+
+		// Builds the palette from the images' colors via median cut.
+		Palette(Image **images, int32_t numImages, int32_t numLightLevels = 32);
+
+		~Palette();
+
+		uint8_t findColor(uint32_t color);
+
+		void setFormat(PixelFormat format);
+
+		const uint32_t *getColorMap(uint8_t lightness) {
+			int32_t level = (lightness * (numLightLevels - 1) + 127) / 255;
+			return colorMaps + (level << 8);
+		}
+	};
+
 	struct Font {
 		uint8_t *pixels;
 		int32_t width;
@@ -50,14 +183,63 @@ namespace lilray {
 		void getBounds(int32_t &width, int32_t &height, const char *fmt, ...);
 	};
 
+	// Storage type of map cells. Narrower types shrink large maps, so more of
+	// them stays in cache while raycasting. Cell values have to fit the type.
+	enum MapCellType {
+		MAP_CELL_INT32,
+		MAP_CELL_UINT16,
+		MAP_CELL_UINT8
+	};
+
+	// Order of cells in memory. Row major cells are stored row by row. Tiled
+	// cells are stored in 8x8 tiles and Morton cells in Z-order, padded to a
+	// power of two square, so rays moving along y stay in the same cache lines
+	// for longer.
+	enum MapLayout {
+		MAP_LAYOUT_ROW_MAJOR,
+		MAP_LAYOUT_TILED,
+		MAP_LAYOUT_MORTON
+	};
+
+	struct ThreadPool;
+
 	struct Map {
 		int32_t width, height;
-		int32_t *cells;
+		MapCellType cellType;
+		MapLayout layout;
+		// int32_t, uint16_t or uint8_t per cell, depending on cellType, ordered
+		// by layout.
+		void *cells;
+		// False if cells are owned by the caller and not deleted with the map.
+		bool ownsCells;
+		// Chebyshev distance from each cell to the nearest wall, capped at
+		// MAX_EMPTY_DISTANCE and ordered like cells. Raycasts leap over the empty
+		// square around a cell instead of stepping through it. nullptr until
+		// createDistanceField() is called.
+		uint8_t *distanceField;
+		static const int32_t MAX_EMPTY_DISTANCE = 32;
 
 		Map(int32_t width, int32_t height, int32_t *cells);
 
+		// Copies the row major cells, converting them to cellType and layout.
+		Map(int32_t width, int32_t height, MapCellType cellType, const int32_t *cells,
+			MapLayout layout = MAP_LAYOUT_ROW_MAJOR);
+
+		// Use row major cells without copying them, see Image(width, height, pixels,
+		// ownsPixels).
+		Map(int32_t width, int32_t height, int32_t *cells, bool ownsCells);
+
+		Map(int32_t width, int32_t height, uint16_t *cells, bool ownsCells);
+
+		Map(int32_t width, int32_t height, uint8_t *cells, bool ownsCells);
+
 		~Map();
 
+		// Builds distanceField. setCell() keeps it up to date, call this again after
+		// writing cells directly. Leaping rounds ray distances slightly
+		// differently, so rays grazing a wall corner may hit or miss that wall.
+		void createDistanceField();
+
 		void setCell(int32_t x, int32_t y, int32_t value);
 
 		int32_t getCell(int32_t x, int32_t y);
@@ -65,6 +247,29 @@ namespace lilray {
 		int32_t
 		raycast(float rayX, float rayY, float rayDirX, float rayDirY, float maxDistance, float &hitX, float &hitY,
 				float &distance);
+
+		// raycast() in 16.16 fixed point, for targets without a fast FPU. Expects a
+		// normalized direction. Ignores the distance field.
+		int32_t raycastFixedPoint(int32_t rayX, int32_t rayY, int32_t rayDirX, int32_t rayDirY, int32_t maxDistance,
+								  int32_t &hitX, int32_t &hitY, int32_t &distance);
+
+		// Casts up to PACKET_SIZE rays in lock step, with the same results as calling
+		// raycast() for each ray. Neighbouring rays usually take the same number of
+		// steps, so this trades the per step branches for masked per lane updates.
+		// cells[i] is 0 if ray i did not hit anything. If steps is given, it receives
+		// the number of DDA steps taken by each ray.
+		static const int32_t PACKET_SIZE = 8;
+
+		void raycastPacket(int32_t numRays, const float *rayX, const float *rayY, const float *rayDirX,
+						   const float *rayDirY, float maxDistance, int32_t *cells, float *hitX, float *hitY,
+						   float *distance, int32_t *steps = nullptr);
+
+		// Casts numRays rays in packets, e.g. for line of sight or hitscan checks.
+		// Ray i stops at maxDistance[i]. With a thread pool, the packets are spread
+		// across its threads.
+		void raycastBatch(int32_t numRays, const float *rayX, const float *rayY, const float *rayDirX,
+						  const float *rayDirY, const float *maxDistance, int32_t *cells, float *hitX, float *hitY,
+						  float *distance, ThreadPool *threadPool = nullptr);
 	};
 
 	struct Camera {
@@ -82,27 +287,249 @@ namespace lilray {
 	struct Sprite {
 		float x, y, height;
 		Image *image;
-		float distance;
+
+		Sprite() : x(0), y(0), height(0), image(nullptr) {}
 
 		Sprite(float x, float y, float height, Image *image) : x(x), y(y), height(height), image(image) {}
 	};
 
+	// Buckets sprites by the map cell they stand in. Rendering with a grid only
+	// visits the cells inside the view frustum, so culling scales with the
+	// sprites near the camera instead of all sprites.
+	struct SpriteGrid {
+		int32_t width, height;
+		int32_t numSprites;
+		// Sprites sorted by cell, cell i holds sprites[cellStarts[i]] up to
+		// sprites[cellStarts[i + 1]]. Index width * height is the overflow
+		// bucket for sprites outside the grid.
+		Sprite **sprites;
+		int32_t *cellStarts;
+		// Largest sprite width in map units, see update().
+		float maxSpriteWidth;
+		int32_t maxSprites;
+
+		SpriteGrid(int32_t width, int32_t height);
+
+		~SpriteGrid();
+
+		// Rebuilds the buckets. Call after adding, removing, moving or resizing
+		// sprites. Sprites outside the grid go into the overflow bucket, which
+		// render() culls sprite by sprite.
+		void update(Sprite *sprites[], int32_t numSprites);
+	};
+
+	// Counters for the last frame rendered. Only collected if lilray.cpp is
+	// compiled with LILRAY_ENABLE_STATS, all zero otherwise. Times are in
+	// milliseconds.
+	struct RenderStats {
+		double floorAndCeilingTime;
+		double wallsTime;
+		double spritesTime;
+		// Part of spritesTime spent sorting the visible sprites.
+		double spriteSortTime;
+		double totalTime;
+		int64_t raysCast;
+		int64_t ddaSteps;
+		int64_t floorAndCeilingPixels;
+		int64_t wallPixels;
+		int64_t spritePixels;
+		// Sprites behind the camera, off screen or fully occluded.
+		int32_t spritesCulled;
+		int32_t spritesDrawn;
+		int32_t spritesSorted;
+		// Pixels written per pixel of the frame.
+		float overdraw;
+	};
+
+	struct ThreadPoolState;
+	struct VisibleSprite;
+
+	struct ThreadPool {
+		int32_t numThreads;
+		ThreadPoolState *state;
+
+		// numThreads <= 0 uses one thread per hardware core. The calling thread
+		// participates in run(), so numThreads - 1 workers are spawned.
+		explicit ThreadPool(int32_t numThreads);
+
+		~ThreadPool();
+
+		// Calls task(data, index) for index in [0, numTasks) across all threads
+		// and returns once every task has finished.
+		void run(int32_t numTasks, void (*task)(void *data, int32_t index), void *data);
+	};
+
 	struct Renderer {
 		Image frame;
 		float *zbuffer;
+		// zbuffer of the fixed point path in 16.16, which leaves zbuffer untouched.
+		int32_t *zbufferFixedPoint;
+		// Scratch space for the visible column runs of a sprite.
+		int32_t *spriteRuns;
+		// Offset of each column's ray along the camera's right vector, for a
+		// direction of length 1. Only rebuilt when the frame width or field of
+		// view changes.
+		float *columnRayOffsets;
+		int32_t columnRaysWidth;
+		float columnRaysFieldOfView;
+		// tan(fieldOfView / 2) for columnRaysFieldOfView.
+		float projectionPlaneWidth;
+		// Normalized camera space ray per column in 16.16 fixed point, along the
+		// view direction and to its right. The forward part also corrects the
+		// fisheye distortion.
+		int32_t *columnRayForwardFixedPoint;
+		int32_t *columnRayRightFixedPoint;
+		int32_t projectionPlaneWidthFixedPoint;
 		Image **wallTextures;
 		int32_t numWallTextures;
+		// Copy of the wall textures the wall pass reads from, see updateWallAtlas().
+		// nullptr until the first render.
+		TextureAtlas *wallAtlas;
 		Image *floorTexture;
 		Image *ceilingTexture;
+		// The caller's textures and palette are never converted. If their format
+		// differs from the frame's, or they need mipmaps they lack, the floor pass
+		// reads these copies. colorMaps holds the palette's color maps in the
+		// frame's format if that differs. Otherwise they are nullptr. Like
+		// wallAtlas, they are rebuilt when the format or palette changes.
+		Image *floorTextureCopy;
+		Image *ceilingTextureCopy;
+		uint32_t *colorMaps;
+		Palette *colorMapsPalette;
+		// Whether wallAtlas and the copies were built with mipmaps for the
+		// textures that have none.
+		bool textureCopiesHaveMipmaps;
+		// Renders walls, floor, ceiling and sprites with integer math and a sine
+		// table, for targets without a fast FPU. Only the camera, lights and
+		// sprite positions are converted from float, once per frame or sprite.
 		bool useFixedPoint;
+		// Uses the SSE2/AVX2/NEON floor and ceiling kernels if the CPU supports them.
+		// They render the same pixels as the scalar code.
+		bool useSimd;
+		// Samples distant walls, floors and ceilings from the textures' mipmaps,
+		// picked per wall column and per floor row, so fewer texels are skipped.
+		// For textures without mipmaps, the renderer creates them in wallAtlas
+		// and its own floor and ceiling copies on the next render. Call
+		// Image::createMipmaps() up front to share them between renderers.
+		bool useMipmaps;
+		// Shades through the palette's color maps instead of darkening true
+		// color texels. Textures without palette indices are drawn in true color.
+		bool usePalette;
+		Palette *palette;
 		bool drawWalls;
 		bool drawFloorAndCeiling;
 		bool drawSprites;
-
+		RenderStats stats;
+		ThreadPool *threadPool;
+		// Sprites that passed culling in the current frame.
+		VisibleSprite *visibleSprites;
+		int32_t numVisibleSprites;
+		int32_t maxVisibleSprites;
+		// Indices into visibleSprites, near to far. sortedSprites holds the
+		// visible sprites of the last sort, to tell if its order can be reused.
+		int32_t *spriteOrder;
+		int32_t *spriteOrderScratch;
+		Sprite **sortedSprites;
+		int32_t numSortedSprites;
+		int32_t maxSortedSprites;
+		// One renderer per view of renderViews(), sharing the textures, wallAtlas
+		// and the copies of this one.
+		Renderer **viewRenderers;
+		int32_t numViewRenderers;
+
+		// The textures are only read, never modified, until setPalette().
+		// nullptr entries in wallTextures are skipped, their cells still block
+		// rays and sprites but show no wall.
 		Renderer(int32_t width, int32_t height, Image *wallTextures[], int32_t numWallTextures,
 				 Image *floorTexture = nullptr, Image *ceilingTexture = nullptr);
 
+		~Renderer();
+
+		// 1 renders on the calling thread only, <= 0 uses all hardware cores.
+		void setNumThreads(int32_t numThreads);
+
+		int32_t getNumThreads();
+
+		// Renders into pixels instead of an internal frame, e.g. a locked texture
+		// or window surface. pitch is in pixels. On the next render, the renderer
+		// converts its copies of the textures and palette to the format, so pixels
+		// are written once without a swizzle pass. Sprite images in another format
+		// are converted per texel, call Image::setFormat() on them to avoid that.
+		// nullptr renders into an internal frame again.
+		void setRenderTarget(uint32_t *pixels, int32_t width, int32_t height, int32_t pitch,
+							 PixelFormat format = PIXEL_FORMAT_ARGB);
+
+		// Quantizes the wall, floor and ceiling textures to the palette. Sprite
+		// images have to be quantized via Image::quantize().
+		void setPalette(Palette *palette);
+
+		// Rebuilds wallAtlas from the wall textures, and the floor and ceiling
+		// copies. Call after modifying texture pixels. Palette and render target
+		// format changes rebuild them already.
+		void updateWallAtlas();
+
+		// Sprites outside the view frustum or behind all walls are culled before
+		// sorting. The sprites array is left in its original order.
 		void render(Camera &camera, Map &map, Sprite *sprites[], int32_t numSprites, float lightDistance);
+
+		// Same as above, but only looks at sprites in grid cells the camera can see.
+		void render(Camera &camera, Map &map, SpriteGrid &sprites, float lightDistance);
+
+		// Renders each camera into the frame with the same index, e.g. for bots or
+		// spectators. The copies of the textures and palette are converted to the
+		// frames' format once for all views, then the views are spread across the
+		// thread pool, one thread per view, all reading the same wall atlas.
+		// Frames may differ in size but must have the same format, nothing is
+		// rendered otherwise. The settings of this renderer apply to all views,
+		// stats are summed over them.
+		void renderViews(int32_t numViews, Camera *cameras[], Image *frames[], Map &map, Sprite *sprites[],
+						 int32_t numSprites, float lightDistance);
+	};
+
+	struct RenderPipelineState;
+
+	// Renders frames on a worker thread into its own buffers, so the caller can
+	// present one frame while the next one is rendered. 2 buffers double buffer,
+	// 3 let the worker render one more frame ahead. Without thread support,
+	// submit() renders on the calling thread.
+	//
+	// A frame loop acquires the last frame, updates the game, submits the next
+	// frame and then presents the acquired one. The renderer, map, sprite images
+	// and palette are read by the worker, so only change them while no frame is
+	// in flight, e.g. between acquire() and submit(), or after finish().
+	struct RenderPipeline {
+		Renderer *renderer;
+		int32_t numBuffers;
+		// Render targets in the renderer's frame size and format, without padding.
+		Image **buffers;
+		// Optional, called on the worker thread once a frame can be acquired,
+		// e.g. to wake up a thread waiting for it.
+		void (*frameReady)(void *data, Image *frame);
+		void *frameReadyData;
+		RenderPipelineState *state;
+
+		// Takes over the renderer's frame, the renderer renders into an internal
+		// frame again once the pipeline is deleted.
+		RenderPipeline(Renderer *renderer, int32_t numBuffers = 2);
+
+		// Waits for submitted frames to finish.
+		~RenderPipeline();
+
+		// Queues a frame. The camera and sprites are copied, so they can change
+		// right away. If no buffer is free, the oldest finished frame that wasn't
+		// acquired yet is dropped and its buffer reused. If there is no such
+		// frame either, e.g. with 2 buffers while one is acquired and the other
+		// is rendering, submit() blocks until the render finishes.
+		void submit(Camera &camera, Map &map, Sprite *sprites[], int32_t numSprites, float lightDistance);
+
+		// Returns the oldest submitted frame that wasn't acquired yet, waiting
+		// for it to finish if wait is true. The frame stays valid until the next
+		// call to acquire(). Returns nullptr if there is no such frame, or if it
+		// isn't finished and wait is false.
+		Image *acquire(bool wait = true);
+
+		// Waits until all submitted frames are rendered.
+		void finish();
 	};
 
 	struct Average {
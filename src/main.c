@@ -43,6 +43,7 @@ int main(int argc, char **argv) {
 	};
 	// clang-format on
 	lilray_image grunt = lilray_image_create_from_file("assets/grunt.png");
+	lilray_image_create_posts(grunt);
 	lilray_sprite sprites[] = {lilray_sprite_create(7.5, 2.5, 0.7, grunt)};
 	lilray_map map = lilray_map_create(21, 21, cells);
 	lilray_camera camera = lilray_camera_create(2.5f, 2.5f, 0, 66);
@@ -55,8 +56,12 @@ int main(int argc, char **argv) {
 	if (!window)
 		return 0;
 	struct mfb_timer *deltaTimer = mfb_timer_create();
+	// The next frame is rendered while the last one is presented.
+	lilray_render_pipeline pipeline = lilray_render_pipeline_create(renderer, 2);
+	lilray_render_pipeline_submit(pipeline, camera, map, sprites, sizeof(sprites) / sizeof(lilray_sprite), 8);
 	do {
 		float delta = mfb_timer_delta(deltaTimer);
+		lilray_image frame = lilray_render_pipeline_acquire(pipeline, 1);
 		if (mfb_get_key_buffer(window)[KB_KEY_A])
 			lilray_camera_rotate(camera, -rotationSpeed * delta);
 		if (mfb_get_key_buffer(window)[KB_KEY_D])
@@ -68,13 +73,9 @@ int main(int argc, char **argv) {
 
 		lilray_camera_move(camera, map, 0.1 * delta);
 
-		lilray_image_clear(lilray_renderer_get_frame(renderer), 0xffcccccc);
-		lilray_renderer_render(renderer, camera, map, sprites,
-							   sizeof(sprites) / sizeof(lilray_sprite), 8);
-		if (mfb_update_ex(
-					window,
-					lilray_image_get_pixels(lilray_renderer_get_frame(renderer)), resX,
-					resY) < 0)
+		lilray_render_pipeline_submit(pipeline, camera, map, sprites, sizeof(sprites) / sizeof(lilray_sprite), 8);
+		if (mfb_update_ex(window, lilray_image_get_pixels(frame), resX, resY) < 0)
 			break;
 	} while (-1);
+	lilray_render_pipeline_dispose(pipeline);
 }
@@ -8,6 +8,22 @@
 using namespace lilray;
 
 static Renderer *renderer;
+static unsigned int pendingCharacter;
+
+static void toggleSetting(unsigned int character) {
+	if (character == '0')
+		renderer->useFixedPoint = !renderer->useFixedPoint;
+	if (character == '1')
+		renderer->drawWalls = !renderer->drawWalls;
+	if (character == '2')
+		renderer->drawFloorAndCeiling = !renderer->drawFloorAndCeiling;
+	if (character == '3')
+		renderer->drawSprites = !renderer->drawSprites;
+	if (character == '4')
+		renderer->setNumThreads(renderer->getNumThreads() == 1 ? 0 : 1);
+	if (character == '5')
+		renderer->usePalette = !renderer->usePalette;
+}
 
 int main(int argc, char **argv) {
 	const int resX = 320, resY = 240, resScale = 2;
@@ -57,27 +73,37 @@ int main(int argc, char **argv) {
 	renderer =
 			new Renderer(resX, resY, textures, sizeof(textures) / sizeof(Image *),
 						 textures[1], textures[2]);
+	Image *paletteImages[] = {textures[0], textures[1], textures[2], textures[3],
+							  textures[4], textures[5], textures[6], &grunt};
+	Palette palette(paletteImages, sizeof(paletteImages) / sizeof(Image *));
+	renderer->setPalette(&palette);
+	grunt.quantize(palette);
+	grunt.createPosts();
 
 	mfb_window *window =
 			mfb_open_ex("lilray", resX * resScale, resY * resScale, WF_RESIZABLE);
 	if (!window)
 		return 0;
 	mfb_timer *deltaTimer = mfb_timer_create();
-	mfb_timer *frameTimer = mfb_timer_create();
+	// Settings are changed between frames, the pipeline may be rendering
+	// while the window processes input.
 	mfb_set_char_input_callback(
 			window, [](mfb_window *window, unsigned int character) {
-				if (character == '0')
-					renderer->useFixedPoint = !renderer->useFixedPoint;
-				if (character == '1')
-					renderer->drawWalls = !renderer->drawWalls;
-				if (character == '2')
-					renderer->drawFloorAndCeiling = !renderer->drawFloorAndCeiling;
-				if (character == '3')
-					renderer->drawSprites = !renderer->drawSprites;
+				pendingCharacter = character;
 			});
-	Average avgFrameTime(50);
+	// The next frame is rendered while the last one is presented.
+	RenderPipeline pipeline(renderer);
+	pipeline.submit(camera, map, sprites, sizeof(sprites) / sizeof(Sprite *), 6);
+	// Time per loop iteration, which includes waiting for the pipeline and
+	// presenting, not just rendering.
+	Average avgLoopTime(50);
 	do {
 		float delta = mfb_timer_delta(deltaTimer);
+		Image *frame = pipeline.acquire();
+		if (pendingCharacter) {
+			toggleSetting(pendingCharacter);
+			pendingCharacter = 0;
+		}
 		if (mfb_get_key_buffer(window)[KB_KEY_A])
 			camera.rotate(-rotationSpeed * delta);
 		if (mfb_get_key_buffer(window)[KB_KEY_D])
@@ -91,25 +117,26 @@ int main(int argc, char **argv) {
 		if (mfb_get_key_buffer(window)[KB_KEY_E])
 			camera.strafe(map, -movementSpeed * delta);
 
-		double start = mfb_timer_now(frameTimer);
-		renderer->render(camera, map, sprites, sizeof(sprites) / sizeof(Sprite *),
-						 6);
-		avgFrameTime.addValue(mfb_timer_now(frameTimer) - start);
+		pipeline.submit(camera, map, sprites, sizeof(sprites) / sizeof(Sprite *), 6);
+		avgLoopTime.addValue(delta);
 
 		char text[255];
 		snprintf(text, 255,
-				 "Frame time: %f\n(0) Use Fixed point:    %s\n(1) Draw walls:      "
-				 "   %s\n(2) Draw floor/ceiling: %s\n(3) Draw sprites:       %s",
-				 avgFrameTime.getAverage(),
+				 "Loop time: %f\n(0) Use Fixed point:    %s\n(1) Draw walls:      "
+				 "   %s\n(2) Draw floor/ceiling: %s\n(3) Draw sprites:       %s\n"
+				 "(4) Threads:            %i\n(5) Use palette:        %s",
+				 avgLoopTime.getAverage(),
 				 renderer->useFixedPoint ? "true" : "false",
 				 renderer->drawWalls ? "true" : "false",
 				 renderer->drawFloorAndCeiling ? "true" : "false",
-				 renderer->drawSprites ? "true" : "false");
+				 renderer->drawSprites ? "true" : "false",
+				 renderer->getNumThreads(),
+				 renderer->usePalette ? "true" : "false");
 		int32_t textWidth, textHeight;
 		font.getBounds(textWidth, textHeight, text);
-		renderer->frame.drawRectangle(0, 0, textWidth, textHeight, 0xff222222);
-		renderer->frame.drawText(font, 0, 1, 0xffcccccc, text);
-		if (mfb_update_ex(window, renderer->frame.pixels, resX, resY) < 0)
+		frame->drawRectangle(0, 0, textWidth, textHeight, 0xff222222);
+		frame->drawText(font, 0, 1, 0xffcccccc, text);
+		if (mfb_update_ex(window, frame->pixels, resX, resY) < 0)
 			break;
 	} while (true);
 }
\ No newline at end of file